@@ -0,0 +1,234 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "poll.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * the calibration run, fds written and waited every round
+ */
+#define EF_CALIBRATE_FDS    32
+#define EF_CALIBRATE_ROUNDS 200
+#define EF_CALIBRATE_BATCH  8
+
+#if defined(__linux__)
+extern const ef_poll_backend_t ef_poll_backend_epoll;
+extern const ef_poll_backend_t ef_poll_backend_epollet;
+extern const ef_poll_backend_t ef_poll_backend_iouring;
+extern const ef_poll_backend_t ef_poll_backend_poll;
+
+static const ef_poll_backend_t *ef_poll_backends[] = {
+    &ef_poll_backend_epoll,
+    &ef_poll_backend_epollet,
+    &ef_poll_backend_iouring,
+    &ef_poll_backend_poll,
+    NULL
+};
+#elif defined(__sun)
+extern const ef_poll_backend_t ef_poll_backend_port;
+extern const ef_poll_backend_t ef_poll_backend_poll;
+
+static const ef_poll_backend_t *ef_poll_backends[] = {
+    &ef_poll_backend_port,
+    &ef_poll_backend_poll,
+    NULL
+};
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+extern const ef_poll_backend_t ef_poll_backend_kqueue;
+extern const ef_poll_backend_t ef_poll_backend_poll;
+
+static const ef_poll_backend_t *ef_poll_backends[] = {
+    &ef_poll_backend_kqueue,
+    &ef_poll_backend_poll,
+    NULL
+};
+#else
+extern const ef_poll_backend_t ef_poll_backend_poll;
+
+static const ef_poll_backend_t *ef_poll_backends[] = {
+    &ef_poll_backend_poll,
+    NULL
+};
+#endif
+
+/*
+ * NULL until selected, the name is "auto" until calibrated
+ */
+static const ef_poll_backend_t *ef_poll_backend = NULL;
+static int ef_poll_auto = 0;
+
+static const ef_poll_backend_t *ef_poll_find(const char *name)
+{
+    int idx;
+
+    for (idx = 0; ef_poll_backends[idx]; ++idx) {
+        if (strcmp(ef_poll_backends[idx]->name, name) == 0) {
+            return ef_poll_backends[idx];
+        }
+    }
+    return NULL;
+}
+
+static long ef_poll_nanosecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * the way the framework uses a backend, associate, wait, read
+ * and dissociate, returns the nanosecs taken or -1 if not usable
+ */
+static long ef_poll_calibrate(const ef_poll_backend_t *b)
+{
+    int pipes[EF_CALIBRATE_FDS][2];
+    ef_event_t evts[EF_CALIBRATE_FDS];
+    ef_poll_t *p;
+    long start, elapsed = -1;
+    int idx, round, count = 0;
+    char c = 0;
+
+    p = b->create(EF_CALIBRATE_FDS);
+    if (!p) {
+        return -1;
+    }
+
+    for (; count < EF_CALIBRATE_FDS; ++count) {
+        if (pipe(pipes[count]) < 0) {
+            goto exit_calibrate;
+        }
+        fcntl(pipes[count][0], F_SETFL, O_NONBLOCK);
+    }
+
+    start = ef_poll_nanosecs();
+    for (round = 0; round < EF_CALIBRATE_ROUNDS; ++round) {
+        int got = 0, tries = 0;
+
+        for (idx = 0; idx < EF_CALIBRATE_BATCH; ++idx) {
+            int fd = (round * EF_CALIBRATE_BATCH + idx) % EF_CALIBRATE_FDS;
+            if (p->associate(p, pipes[fd][0], EF_POLLIN, pipes[fd], 0) < 0 || write(pipes[fd][1], &c, 1) != 1) {
+                goto exit_calibrate;
+            }
+        }
+
+        while (got < EF_CALIBRATE_BATCH) {
+            int cnt = p->wait(p, evts, EF_CALIBRATE_FDS, 10);
+            if (cnt < 0 || ++tries > EF_CALIBRATE_BATCH * 4) {
+                goto exit_calibrate;
+            }
+            for (idx = 0; idx < cnt; ++idx) {
+                int *fds = (int *)evts[idx].ptr;
+                if (read(fds[0], &c, 1) == 1) {
+                    p->dissociate(p, fds[0], 1, 0);
+                    ++got;
+                } else {
+                    p->unset(p, fds[0], EF_POLLIN);
+                }
+            }
+        }
+    }
+    elapsed = ef_poll_nanosecs() - start;
+
+exit_calibrate:
+    for (idx = 0; idx < count; ++idx) {
+        p->dissociate(p, pipes[idx][0], 0, 1);
+        close(pipes[idx][0]);
+        close(pipes[idx][1]);
+    }
+    p->free(p);
+    return elapsed;
+}
+
+static const ef_poll_backend_t *ef_poll_fastest(void)
+{
+    const ef_poll_backend_t *fastest = NULL;
+    long best = 0;
+    int idx;
+
+    for (idx = 0; ef_poll_backends[idx]; ++idx) {
+        long elapsed = ef_poll_calibrate(ef_poll_backends[idx]);
+        if (elapsed >= 0 && (!fastest || elapsed < best)) {
+            fastest = ef_poll_backends[idx];
+            best = elapsed;
+        }
+    }
+    return fastest;
+}
+
+int ef_poll_select(const char *name)
+{
+    const ef_poll_backend_t *b;
+
+    if (strcmp(name, "auto") == 0) {
+        ef_poll_backend = NULL;
+        ef_poll_auto = 1;
+        return 0;
+    }
+
+    b = ef_poll_find(name);
+    if (!b) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    ef_poll_backend = b;
+    ef_poll_auto = 0;
+    return 0;
+}
+
+const char *ef_poll_selected(void)
+{
+    if (ef_poll_backend) {
+        return ef_poll_backend->name;
+    }
+    return ef_poll_auto ? "auto" : NULL;
+}
+
+static ef_poll_t *ef_poll_registry_create(int cap)
+{
+    const char *name;
+
+    /*
+     * an unknown name in the environment falls back to the default
+     */
+    if (!ef_poll_backend && !ef_poll_auto) {
+        name = getenv("EF_POLL");
+        if (name) {
+            ef_poll_select(name);
+        }
+    }
+
+    if (!ef_poll_backend && ef_poll_auto) {
+        ef_poll_backend = ef_poll_fastest();
+    }
+
+    if (!ef_poll_backend) {
+        ef_poll_backend = ef_poll_backends[0];
+    }
+    return ef_poll_backend->create(cap);
+}
+
+create_func_t ef_create_poll = ef_poll_registry_create;
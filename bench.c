@@ -0,0 +1,160 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * measures the framework itself, built with EF_LOOPBACK and the loopback
+ * backend every connection lives in memory, so the time left is spent
+ * in the loop, the routines and the io calls of the framework
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "framework.h"
+#include "util/util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_cycles() __rdtsc()
+#else
+#define bench_cycles() 0ULL
+#endif
+
+#define EF_LOOPBACK_SHIM
+#include "loopback.h"
+
+#define BENCH_PORT 8080
+
+ef_runtime_t efr = {0};
+
+static int clients = 64;
+static int conns = 100;
+static int rounds = 100;
+static int msg_size = 64;
+static int finished = 0;
+static unsigned long ops = 0;
+
+long echo_proc(int fd, ef_routine_t *er)
+{
+    char buffer[4096];
+    while (1) {
+        ssize_t r = ef_routine_read(er, fd, buffer, sizeof(buffer));
+        if (r <= 0) {
+            return r;
+        }
+        if (ef_routine_write_all(er, fd, buffer, r) < 0) {
+            return -1;
+        }
+    }
+}
+
+long client_proc(void *arg, ef_routine_t *er)
+{
+    char buffer[4096];
+    struct sockaddr_in addr_in = {0};
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_port = htons(BENCH_PORT);
+
+    for (int c = 0; c < conns; ++c) {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0 || ef_routine_connect(er, sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in)) < 0) {
+            break;
+        }
+        for (int i = 0; i < rounds; ++i) {
+            if (ef_routine_write_all(er, sockfd, buffer, msg_size) != msg_size ||
+                ef_routine_read_exact(er, sockfd, buffer, msg_size) != msg_size) {
+                break;
+            }
+            ++ops;
+        }
+        ef_routine_close(er, sockfd);
+    }
+
+    if (++finished == clients) {
+        efr.stopping = 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        clients = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        conns = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        rounds = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        msg_size = atoi(argv[4]);
+    }
+    if (clients <= 0 || conns <= 0 || rounds <= 0 || msg_size <= 0 || msg_size > 4096) {
+        fprintf(stderr, "usage: %s [clients] [conns per client] [rounds per conn] [msg size]\n", argv[0]);
+        return -1;
+    }
+
+    if (ef_init(&efr, 64 * 1024, clients * 2, clients * 2 + 16, 1000 * 60, 16) < 0) {
+        return -1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr_in = {0};
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_port = htons(BENCH_PORT);
+    if (bind(sockfd, (const struct sockaddr *)&addr_in, sizeof(addr_in)) < 0 || listen(sockfd, clients) < 0) {
+        return -1;
+    }
+    ef_add_listen(&efr, sockfd, echo_proc);
+
+    for (int i = 0; i < clients; ++i) {
+        ef_routine_t *er = ef_routine_spawn(client_proc, NULL);
+        if (!er) {
+            return -1;
+        }
+        ef_routine_detach(er);
+    }
+
+    long start = ef_time_microsecs();
+    unsigned long long cycles = bench_cycles();
+    int retval = ef_run_loop(&efr);
+    cycles = bench_cycles() - cycles;
+    long usecs = ef_time_microsecs() - start;
+    if (usecs <= 0) {
+        usecs = 1;
+    }
+
+    printf("%lu round trips, %d connections in %ld usecs, %.0f ops/sec, %.0f conns/sec\n",
+        ops, clients * conns, usecs, ops * 1e6 / usecs, clients * conns * 1e6 / usecs);
+    printf("io direct %lu, polled %lu\n", efr.io_direct, efr.io_polled);
+
+    /*
+     * tsc cycles, the loop, the routines and the io calls
+     * of a round trip both sides, where the tsc is readable
+     */
+    if (cycles && ops) {
+        printf("%.0f cycles per round trip\n", (double)cycles / ops);
+    }
+    return retval;
+}
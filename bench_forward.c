@@ -0,0 +1,210 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * forwarding throughput over kernel tcp connections, the bytes of each
+ * stream go source -> forwarder -> sink, the forwarder copies them
+ * through a buffer first as forward_proc did, then splices them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "framework.h"
+#include "util/util.h"
+
+#define BUFFER_SIZE 8192
+
+typedef struct _stream {
+    int fds[4];
+    int splice;
+} stream_t;
+
+ef_runtime_t efr = {0};
+
+static int streams = 4;
+static long megabytes = 256;
+static int listen_fd = -1;
+
+long source_proc(void *arg, ef_routine_t *er)
+{
+    stream_t *st = (stream_t *)arg;
+    static char buffer[EF_SPLICE_CHUNK];
+    long left = megabytes << 20;
+
+    while (left > 0) {
+        size_t len = left < (long)sizeof(buffer) ? (size_t)left : sizeof(buffer);
+        ssize_t w = ef_routine_write_all(er, st->fds[0], buffer, len);
+        if (w <= 0) {
+            break;
+        }
+        left -= w;
+    }
+    ef_routine_close(er, st->fds[0]);
+    return 0;
+}
+
+long forward_proc(void *arg, ef_routine_t *er)
+{
+    stream_t *st = (stream_t *)arg;
+    char buffer[BUFFER_SIZE];
+    ssize_t r;
+
+    if (st->splice) {
+        r = ef_routine_forward_all(er, st->fds[1], st->fds[2]);
+    } else {
+        while ((r = ef_routine_read(er, st->fds[1], buffer, BUFFER_SIZE)) > 0) {
+            if (ef_routine_write_all(er, st->fds[2], buffer, r) < 0) {
+                break;
+            }
+        }
+    }
+    ef_routine_close(er, st->fds[1]);
+    ef_routine_close(er, st->fds[2]);
+    return r;
+}
+
+long sink_proc(void *arg, ef_routine_t *er)
+{
+    stream_t *st = (stream_t *)arg;
+    static char buffer[EF_SPLICE_CHUNK];
+    long total = 0;
+    ssize_t r;
+
+    while ((r = ef_routine_read(er, st->fds[3], buffer, sizeof(buffer))) > 0) {
+        total += r;
+    }
+    ef_routine_close(er, st->fds[3]);
+    return total;
+}
+
+/*
+ * a connected pair through the listener, done before the loop runs
+ */
+static int tcp_pair(int *fds)
+{
+    struct sockaddr_in addr_in;
+    socklen_t len = sizeof(addr_in);
+
+    if (getsockname(listen_fd, (struct sockaddr *)&addr_in, &len) < 0) {
+        return -1;
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] < 0 || connect(fds[0], (const struct sockaddr *)&addr_in, len) < 0) {
+        return -1;
+    }
+    fds[1] = accept(listen_fd, NULL, NULL);
+    if (fds[1] < 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+long run_proc(void *arg, ef_routine_t *er)
+{
+    stream_t *st = (stream_t *)calloc(streams, sizeof(stream_t));
+    ef_routine_t **ers = (ef_routine_t **)calloc(streams * 3, sizeof(ef_routine_t *));
+    ef_spawn_proc_t procs[3] = {source_proc, forward_proc, sink_proc};
+
+    for (int mode = 0; st && ers && mode < 2; ++mode) {
+        long moved = 0, ret;
+        long start = ef_time_microsecs();
+
+        for (int i = 0; i < streams; ++i) {
+            st[i].splice = mode;
+            if (tcp_pair(&st[i].fds[0]) < 0 || tcp_pair(&st[i].fds[2]) < 0) {
+                perror("tcp_pair");
+                efr.stopping = 1;
+                return -1;
+            }
+            for (int j = 0; j < 3; ++j) {
+                ers[i * 3 + j] = ef_routine_spawn(procs[j], &st[i]);
+            }
+        }
+        for (int i = 0; i < streams * 3; ++i) {
+            if (ers[i] && ef_routine_join(er, ers[i], &ret) == 0 && i % 3 == 2) {
+                moved += ret;
+            }
+        }
+
+        long usecs = ef_time_microsecs() - start;
+        if (usecs <= 0) {
+            usecs = 1;
+        }
+        printf("%-6s %ld bytes, %d streams in %ld usecs, %.1f MB/s\n",
+            mode ? "splice" : "copy", moved, streams, usecs, moved * 1e6 / usecs / (1 << 20));
+
+        /*
+         * the joined routines go back to the pool once the loop
+         * resumes them, before the next mode spawns its own
+         */
+        ef_routine_yield(er);
+    }
+
+    free(ers);
+    free(st);
+    efr.stopping = 1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        streams = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        megabytes = atol(argv[2]);
+    }
+    if (streams <= 0 || megabytes <= 0) {
+        fprintf(stderr, "usage: %s [streams] [megabytes per stream]\n", argv[0]);
+        return -1;
+    }
+
+    if (ef_init(&efr, 64 * 1024, streams * 3 + 1, streams * 3 + 16, 1000 * 60, 16) < 0) {
+        return -1;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr_in = {0};
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (const struct sockaddr *)&addr_in, sizeof(addr_in)) < 0 || listen(listen_fd, 16) < 0) {
+        return -1;
+    }
+
+    ef_routine_t *er = ef_routine_spawn(run_proc, NULL);
+    if (!er) {
+        return -1;
+    }
+    ef_routine_detach(er);
+
+    int retval = ef_run_loop(&efr);
+    close(listen_fd);
+    return retval;
+}
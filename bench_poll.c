@@ -0,0 +1,359 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * compares the backends on kernel tcp connections, every pair echoes a
+ * small message back and forth, built with EF_POLL_REGISTRY so the
+ * backend is picked by name, like EF_POLL=iouring or the first argument,
+ * idle eventfds never signaled stay registered meanwhile, so the cost a
+ * backend pays for every fd registered shows up, with 0 pairs the ops of
+ * the backend are driven directly, without routines or tcp, at 1k, 10k
+ * and 50k idle fds in turn when the idle fds are not given
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "framework.h"
+#include "poll.h"
+#include "util/util.h"
+
+#define MSG_SIZE 64
+
+/*
+ * idle fds waited by one routine
+ */
+#define IDLE_PER_ROUTINE 256
+
+/*
+ * eventfds signaled every round of the direct run
+ */
+#define OPS_ACTIVE 64
+
+/*
+ * idle fds of the scaling run
+ */
+static const int scale_idle[] = {1000, 10000, 50000};
+
+ef_runtime_t efr = {0};
+
+static int pairs = 64;
+static int rounds = 10000;
+static int idle = 0;
+static int finished = 0;
+static unsigned long ops = 0;
+static long start = 0;
+static long usecs = 0;
+
+/*
+ * keeps its fds registered until cancelled at the end
+ */
+long idle_proc(void *arg, ef_routine_t *er)
+{
+    int *fds = (int *)arg;
+    int events[IDLE_PER_ROUTINE];
+    int n = fds[0];
+
+    for (int i = 0; i < n; ++i) {
+        events[i] = EF_POLLIN;
+    }
+    ef_routine_poll(er, fds + 1, events, n, -1);
+    for (int i = 1; i <= n; ++i) {
+        close(fds[i]);
+    }
+    free(fds);
+    return 0;
+}
+
+long echo_proc(void *arg, ef_routine_t *er)
+{
+    int fd = (int)(long)arg;
+    char buffer[MSG_SIZE];
+
+    while (ef_routine_read_exact(er, fd, buffer, MSG_SIZE) == MSG_SIZE) {
+        if (ef_routine_write_all(er, fd, buffer, MSG_SIZE) < 0) {
+            break;
+        }
+    }
+    ef_routine_close(er, fd);
+    return 0;
+}
+
+long client_proc(void *arg, ef_routine_t *er)
+{
+    int fd = (int)(long)arg;
+    char buffer[MSG_SIZE] = {0};
+
+    for (int i = 0; i < rounds; ++i) {
+        if (ef_routine_write_all(er, fd, buffer, MSG_SIZE) < 0 ||
+            ef_routine_read_exact(er, fd, buffer, MSG_SIZE) != MSG_SIZE) {
+            break;
+        }
+        ++ops;
+    }
+    ef_routine_close(er, fd);
+
+    if (++finished == pairs) {
+        usecs = ef_time_microsecs() - start;
+        efr.stopping = 1;
+    }
+    return 0;
+}
+
+/*
+ * the way the framework uses a backend, associate, wait, read and
+ * dissociate, on OPS_ACTIVE eventfds while the idle ones stay registered
+ */
+static int ops_bench(int idle)
+{
+    static int active[OPS_ACTIVE];
+    ef_event_t evts[OPS_ACTIVE];
+    int *idle_fds = (int *)malloc(sizeof(int) * (idle + 1));
+    uint64_t value = 1;
+    ef_poll_t *p;
+
+    p = ef_create_poll(idle + OPS_ACTIVE + 16);
+    if (!p || !idle_fds) {
+        return -1;
+    }
+
+    long start = ef_time_microsecs();
+    for (int i = 0; i < idle; ++i) {
+        idle_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (idle_fds[i] < 0 || p->associate(p, idle_fds[i], EF_POLLIN, &idle_fds[i], 0) < 0) {
+            perror("idle fd");
+            return -1;
+        }
+    }
+    long reg_usecs = ef_time_microsecs() - start;
+
+    for (int i = 0; i < OPS_ACTIVE; ++i) {
+        active[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (active[i] < 0) {
+            return -1;
+        }
+    }
+
+    start = ef_time_microsecs();
+    for (int r = 0; r < rounds; ++r) {
+        int got = 0;
+
+        for (int i = 0; i < OPS_ACTIVE; ++i) {
+            if (p->associate(p, active[i], EF_POLLIN, &active[i], 0) < 0 || write(active[i], &value, sizeof(value)) != sizeof(value)) {
+                return -1;
+            }
+        }
+        while (got < OPS_ACTIVE) {
+            int cnt = p->wait(p, evts, OPS_ACTIVE, 1000);
+            if (cnt < 0) {
+                return -1;
+            }
+            for (int i = 0; i < cnt; ++i) {
+                int fd = *(int *)evts[i].ptr;
+                if (read(fd, &value, sizeof(value)) == sizeof(value)) {
+                    p->dissociate(p, fd, 1, 0);
+                    ++got;
+                } else {
+                    p->unset(p, fd, EF_POLLIN);
+                }
+            }
+        }
+    }
+    long usecs = ef_time_microsecs() - start;
+    if (usecs <= 0) {
+        usecs = 1;
+    }
+
+    printf("%s: %d idle fds registered in %ld usecs, %ld io cycles in %ld usecs, %.0f ns per cycle\n",
+        ef_poll_selected(), idle, reg_usecs, (long)rounds * OPS_ACTIVE, usecs, usecs * 1000.0 / rounds / OPS_ACTIVE);
+
+    for (int i = 0; i < OPS_ACTIVE; ++i) {
+        p->dissociate(p, active[i], 0, 1);
+        close(active[i]);
+    }
+    for (int i = 0; i < idle; ++i) {
+        p->dissociate(p, idle_fds[i], 0, 1);
+        close(idle_fds[i]);
+    }
+    free(idle_fds);
+    p->free(p);
+    return 0;
+}
+
+/*
+ * room for the fds, raising the hard limit needs privileges
+ */
+static int raise_nofile(rlim_t count)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= count) {
+        return 0;
+    }
+    rl.rlim_cur = count;
+    if (rl.rlim_max < rl.rlim_cur) {
+        rl.rlim_max = rl.rlim_cur;
+    }
+    return setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/*
+ * a connected pair through the listener, done before the loop runs
+ */
+static int tcp_pair(int listen_fd, int *fds)
+{
+    struct sockaddr_in addr_in;
+    socklen_t len = sizeof(addr_in);
+
+    if (getsockname(listen_fd, (struct sockaddr *)&addr_in, &len) < 0) {
+        return -1;
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] < 0 || connect(fds[0], (const struct sockaddr *)&addr_in, len) < 0) {
+        return -1;
+    }
+    fds[1] = accept(listen_fd, NULL, NULL);
+    if (fds[1] < 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && ef_poll_select(argv[1]) < 0) {
+        fprintf(stderr, "unknown backend %s\n", argv[1]);
+        return -1;
+    }
+    if (argc > 2) {
+        pairs = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        rounds = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        idle = atoi(argv[4]);
+    }
+    if (pairs < 0 || rounds <= 0 || idle < 0) {
+        fprintf(stderr, "usage: %s [backend] [pairs] [rounds per pair] [idle fds]\n", argv[0]);
+        return -1;
+    }
+
+    /*
+     * the sizes the fd limit does not allow are skipped
+     */
+    if (pairs == 0 && argc <= 4) {
+        for (int i = 0; i < (int)(sizeof(scale_idle) / sizeof(scale_idle[0])); ++i) {
+            if (raise_nofile((rlim_t)scale_idle[i] + OPS_ACTIVE + 64) < 0) {
+                printf("%s: %d idle fds skipped, RLIMIT_NOFILE too low\n", ef_poll_selected(), scale_idle[i]);
+                continue;
+            }
+            if (ops_bench(scale_idle[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (raise_nofile((rlim_t)idle + pairs * 2 + 64) < 0) {
+        perror("setrlimit");
+        return -1;
+    }
+
+    if (pairs == 0) {
+        return ops_bench(idle);
+    }
+
+    int idle_routines = (idle + IDLE_PER_ROUTINE - 1) / IDLE_PER_ROUTINE;
+    if (ef_init(&efr, 64 * 1024, pairs * 2 + idle_routines, pairs * 2 + idle_routines + 16, 1000 * 60, 16) < 0) {
+        return -1;
+    }
+
+    /*
+     * the idle routines are cancelled soon after the pairs finish
+     */
+    efr.drain_millisecs = 10;
+    for (int i = 0; i < idle; i += IDLE_PER_ROUTINE) {
+        int n = idle - i < IDLE_PER_ROUTINE ? idle - i : IDLE_PER_ROUTINE;
+        int *fds = (int *)malloc(sizeof(int) * (n + 1));
+        if (!fds) {
+            return -1;
+        }
+        fds[0] = n;
+        for (int j = 1; j <= n; ++j) {
+            fds[j] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fds[j] < 0) {
+                perror("eventfd");
+                return -1;
+            }
+        }
+        ef_routine_t *er = ef_routine_spawn(idle_proc, fds);
+        if (!er) {
+            return -1;
+        }
+        ef_routine_detach(er);
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr_in = {0};
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (const struct sockaddr *)&addr_in, sizeof(addr_in)) < 0 || listen(listen_fd, pairs) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < pairs; ++i) {
+        int fds[2];
+        if (tcp_pair(listen_fd, fds) < 0) {
+            perror("tcp_pair");
+            return -1;
+        }
+        ef_routine_t *client = ef_routine_spawn(client_proc, (void *)(long)fds[0]);
+        ef_routine_t *echo = ef_routine_spawn(echo_proc, (void *)(long)fds[1]);
+        if (!client || !echo) {
+            return -1;
+        }
+        ef_routine_detach(client);
+        ef_routine_detach(echo);
+    }
+    close(listen_fd);
+
+    start = ef_time_microsecs();
+    int retval = ef_run_loop(&efr);
+    if (usecs <= 0) {
+        usecs = 1;
+    }
+
+    printf("%s: %lu round trips, %d pairs, %d idle fds in %ld usecs, %.0f ops/sec\n",
+        ef_poll_selected(), ops, pairs, idle, usecs, ops * 1e6 / usecs);
+    return retval;
+}
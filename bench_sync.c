@@ -0,0 +1,225 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/*
+ * handoff latency of sync.c, two routines pass the turn back and
+ * forth through one kind of primitive, every pass parks one routine
+ * and wakes the other through the loop, no fd is involved
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "framework.h"
+#include "sync.h"
+
+typedef struct _bench_case {
+    const char *name;
+    ef_spawn_proc_t ping;
+    ef_spawn_proc_t pong;
+} bench_case_t;
+
+ef_runtime_t efr = {0};
+
+static int rounds = 100000;
+
+static ef_mutex_t mutex;
+static ef_cond_t cond;
+static int turn;
+static ef_sem_t sem_ping, sem_pong;
+static ef_waitgroup_t wg_ping, wg_pong;
+static ef_chan_t chan_ping, chan_pong;
+
+static long bench_microsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * unlock hands the mutex to the waiter, whose lock returns while
+ * the unlocker blocks on its next lock, once the other is waiting
+ */
+long mutex_proc(void *arg, ef_routine_t *er)
+{
+    ef_mutex_lock(&mutex, er);
+    ef_routine_yield(er);
+    ef_mutex_unlock(&mutex, er);
+    for (int i = 1; i < rounds; ++i) {
+        ef_mutex_lock(&mutex, er);
+        ef_mutex_unlock(&mutex, er);
+    }
+    return 0;
+}
+
+long cond_proc(void *arg, ef_routine_t *er)
+{
+    int mine = (int)(long)arg;
+    for (int i = 0; i < rounds; ++i) {
+        ef_mutex_lock(&mutex, er);
+        while (turn != mine) {
+            ef_cond_wait(&cond, &mutex, er);
+        }
+        turn = !mine;
+        ef_cond_signal(&cond);
+        ef_mutex_unlock(&mutex, er);
+    }
+    return 0;
+}
+
+long sem_ping_proc(void *arg, ef_routine_t *er)
+{
+    for (int i = 0; i < rounds; ++i) {
+        ef_sem_post(&sem_ping);
+        ef_sem_wait(&sem_pong, er);
+    }
+    return 0;
+}
+
+long sem_pong_proc(void *arg, ef_routine_t *er)
+{
+    for (int i = 0; i < rounds; ++i) {
+        ef_sem_wait(&sem_ping, er);
+        ef_sem_post(&sem_pong);
+    }
+    return 0;
+}
+
+/*
+ * wg_ping starts at 1, each side rearms the group it waits on
+ * before releasing the other side
+ */
+long wg_ping_proc(void *arg, ef_routine_t *er)
+{
+    for (int i = 0; i < rounds; ++i) {
+        ef_waitgroup_add(&wg_pong, 1);
+        ef_waitgroup_done(&wg_ping);
+        ef_waitgroup_wait(&wg_pong, er);
+    }
+    return 0;
+}
+
+long wg_pong_proc(void *arg, ef_routine_t *er)
+{
+    for (int i = 0; i < rounds; ++i) {
+        ef_waitgroup_wait(&wg_ping, er);
+        ef_waitgroup_add(&wg_ping, 1);
+        ef_waitgroup_done(&wg_pong);
+    }
+    return 0;
+}
+
+long chan_ping_proc(void *arg, ef_routine_t *er)
+{
+    void *item = NULL;
+    for (int i = 0; i < rounds; ++i) {
+        if (ef_chan_send(&chan_ping, item, er) < 0 || ef_chan_recv(&chan_pong, &item, er) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+long chan_pong_proc(void *arg, ef_routine_t *er)
+{
+    void *item;
+    for (int i = 0; i < rounds; ++i) {
+        if (ef_chan_recv(&chan_ping, &item, er) < 0 || ef_chan_send(&chan_pong, item, er) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const bench_case_t cases[] = {
+    {"mutex", mutex_proc, mutex_proc},
+    {"cond", cond_proc, cond_proc},
+    {"sem", sem_ping_proc, sem_pong_proc},
+    {"waitgroup", wg_ping_proc, wg_pong_proc},
+    {"chan", chan_ping_proc, chan_pong_proc},
+};
+
+/*
+ * runs the cases one by one in a routine, joins both sides of each
+ */
+long bench_proc(void *arg, ef_routine_t *er)
+{
+    for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); ++c) {
+        ef_mutex_init(&mutex);
+        ef_cond_init(&cond);
+        turn = 0;
+        ef_sem_init(&sem_ping, 0);
+        ef_sem_init(&sem_pong, 0);
+        ef_waitgroup_init(&wg_ping);
+        ef_waitgroup_init(&wg_pong);
+        ef_waitgroup_add(&wg_ping, 1);
+        if (ef_chan_init(&chan_ping, 1) < 0 || ef_chan_init(&chan_pong, 1) < 0) {
+            break;
+        }
+
+        long start = bench_microsecs();
+        ef_routine_t *ping = ef_routine_spawn(cases[c].ping, (void *)0L);
+        ef_routine_t *pong = ef_routine_spawn(cases[c].pong, (void *)1L);
+        if (!ping || !pong) {
+            break;
+        }
+        ef_routine_join(er, ping, NULL);
+        ef_routine_join(er, pong, NULL);
+        long usecs = bench_microsecs() - start;
+        if (usecs <= 0) {
+            usecs = 1;
+        }
+
+        ef_chan_free(&chan_ping);
+        ef_chan_free(&chan_pong);
+
+        /*
+         * a round passes the turn there and back
+         */
+        printf("%s: %d handoffs in %ld usecs, %.0f ns per handoff\n",
+            cases[c].name, rounds * 2, usecs, usecs * 1e3 / (rounds * 2.0));
+    }
+
+    efr.stopping = 1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        rounds = atoi(argv[1]);
+    }
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        return -1;
+    }
+
+    if (ef_init(&efr, 64 * 1024, 4, 16, 1000 * 60, 16) < 0) {
+        return -1;
+    }
+
+    ef_routine_t *er = ef_routine_spawn(bench_proc, NULL);
+    if (!er) {
+        return -1;
+    }
+    ef_routine_detach(er);
+
+    return ef_run_loop(&efr);
+}
@@ -34,6 +34,9 @@ int ef_coroutine_pool_init(ef_coroutine_pool_t *pool, size_t stack_size, int lim
     pool->full_count = 0;
     pool->free_count = 0;
     pool->run_count = 0;
+#ifdef EF_ENABLE_WATCHDOG
+    pool->switch_seq = 0;
+#endif
     return 0;
 }
 
@@ -74,7 +77,16 @@ long ef_coroutine_resume(ef_coroutine_pool_t *pool, ef_coroutine_t *co, long to_
 {
     long retval = 0;
 
+#ifdef EF_ENABLE_WATCHDOG
+    __atomic_store_n(&pool->switch_seq, pool->switch_seq + 1, __ATOMIC_RELEASE);
+#endif
+
     int res = ef_fiber_resume(&pool->fiber_sched, &co->fiber, to_yield, &retval);
+
+#ifdef EF_ENABLE_WATCHDOG
+    __atomic_store_n(&pool->switch_seq, pool->switch_seq + 1, __ATOMIC_RELEASE);
+#endif
+
     if (res < 0) {
         return retval;
     }
@@ -103,6 +103,14 @@ typedef struct _ef_coroutine_pool {
      * total run count of coroutines in the pool
      */
     unsigned long run_count;
+
+#ifdef EF_ENABLE_WATCHDOG
+    /*
+     * bumped before and after every resume, odd while a coroutine running,
+     * sampled by the watchdog thread
+     */
+    unsigned long switch_seq;
+#endif
 } ef_coroutine_pool_t;
 
 typedef ef_fiber_proc_t ef_coroutine_proc_t;
@@ -19,23 +19,196 @@
 // THE SOFTWARE.
 
 #include "poll.h"
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
+#ifdef EF_EPOLL_URING
+#include "uring.h"
+#endif
+
 typedef struct epoll_event epoll_event_t;
 
+/*
+ * fds stay registered until closed, mask is the interest registered,
+ * 0 if not registered, nobody waiting when waiting is 0
+ */
+typedef struct _ef_epoll_fd {
+    int mask;
+    int waiting;
+    void *ptr;
+#ifdef EF_EPOLL_URING
+    /*
+     * the kernel copies it when the queued ctl submitted
+     */
+    epoll_event_t ctl_event;
+#endif
+} ef_epoll_fd_t;
+
 typedef struct _ef_epoll {
     ef_poll_t poll;
     int epfd;
     int cap;
+    int fd_cap;
+    ef_epoll_fd_t *fds;
+#ifdef EF_EPOLL_URING
+    /*
+     * ctl changes of a loop tick go in one io_uring_enter right before
+     * epoll_wait, ring.fd < 0 where IORING_OP_EPOLL_CTL not supported
+     */
+    ef_uring_t ring;
+#endif
     epoll_event_t events[0];
 } ef_epoll_t;
 
-static int ef_epoll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+static int ef_epoll_ctl(ef_epoll_t *ep, int fd, int mask, int events)
+{
+    epoll_event_t e;
+    int ret;
+
+    e.events = events;
+    e.data.fd = fd;
+    ret = epoll_ctl(ep->epfd, mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &e);
+
+    /*
+     * the fd closed and reused without dissociate, or the other way
+     */
+    if (ret < 0 && errno == ENOENT && mask) {
+        ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &e);
+    } else if (ret < 0 && errno == EEXIST) {
+        ret = epoll_ctl(ep->epfd, EPOLL_CTL_MOD, fd, &e);
+    }
+    return ret;
+}
+
+#ifdef EF_EPOLL_URING
+static int ef_epoll_queue(ef_epoll_t *ep, int op, int fd, int events)
+{
+    ef_epoll_fd_t *ef = &ep->fds[fd];
+    ef_uring_sqe_t *sqe = ef_uring_get_sqe(&ep->ring);
+
+    /*
+     * the sq is full, submit what queued so far
+     */
+    if (!sqe && ef_uring_enter(&ep->ring, 0, 0) >= 0) {
+        --ep->poll.ctl_saved;
+        sqe = ef_uring_get_sqe(&ep->ring);
+    }
+    if (!sqe) {
+        if (op == EPOLL_CTL_DEL) {
+            return epoll_ctl(ep->epfd, op, fd, &ef->ctl_event);
+        }
+        return ef_epoll_ctl(ep, fd, ef->mask, events);
+    }
+
+    ef->ctl_event.events = events;
+    ef->ctl_event.data.fd = fd;
+    sqe->opcode = IORING_OP_EPOLL_CTL;
+    sqe->fd = ep->epfd;
+    sqe->off = fd;
+    sqe->len = op;
+    sqe->addr = (__u64)(uintptr_t)&ef->ctl_event;
+    sqe->user_data = ((__u64)(unsigned int)fd << 2) | op;
+    ++ep->poll.ctl_saved;
+    return 0;
+}
+
+/*
+ * submit the queued ctls, the failed ones are retried directly, waiters
+ * of the fds still failing get EF_POLLERR
+ */
+static int ef_epoll_flush(ef_epoll_t *ep, ef_event_t *evts, int count)
+{
+    ef_uring_cqe_t *cqe;
+    int cnt = 0;
+
+    /*
+     * nothing queued and nothing completed, no enter this tick
+     */
+    if (ep->ring.sq_tail == *ep->ring.sq_ktail && !ep->ring.to_submit && ef_uring_cq_ready(&ep->ring) == 0) {
+        return 0;
+    }
+
+    /*
+     * each queued ctl counted as saved, the enter submitting them is
+     * a syscall too, so the batch saves one less
+     */
+    if (ep->ring.sq_tail != *ep->ring.sq_ktail || ep->ring.to_submit) {
+        --ep->poll.ctl_saved;
+    }
+    if (ef_uring_enter(&ep->ring, 0, 0) <= 0) {
+        return 0;
+    }
+
+    while ((cqe = ef_uring_peek_cqe(&ep->ring)) != NULL) {
+        int fd = (int)(cqe->user_data >> 2);
+        int op = (int)(cqe->user_data & 3);
+        int res = cqe->res;
+        ef_epoll_fd_t *ef;
+
+        ef_uring_cqe_seen(&ep->ring);
+        if (res >= 0 || op == EPOLL_CTL_DEL || fd >= ep->fd_cap) {
+            continue;
+        }
+
+        /*
+         * closed and reused, or dissociated with onclose since queued
+         */
+        ef = &ep->fds[fd];
+        if (ef->mask && (res == -ENOENT || res == -EEXIST) && ef_epoll_ctl(ep, fd, res == -EEXIST, ef->mask) == 0) {
+            continue;
+        }
+
+        ef->mask = 0;
+        if (ef->waiting && cnt < count) {
+            ef->waiting = 0;
+            evts[cnt].events = EF_POLLERR;
+            evts[cnt].res = 0;
+            evts[cnt].ptr = ef->ptr;
+            ++cnt;
+        }
+    }
+    return cnt;
+}
+#endif
+
+static int ef_epoll_expand(ef_epoll_t *ep, int fd)
+{
+    int fd_cap = ep->fd_cap;
+    ef_epoll_fd_t *fds;
+
+    while (fd_cap <= fd) {
+        fd_cap <<= 1;
+    }
+
+#ifdef EF_EPOLL_URING
+    /*
+     * queued ctls point into the table
+     */
+    if (ep->ring.fd >= 0) {
+        ef_uring_enter(&ep->ring, 0, 0);
+    }
+#endif
+
+    fds = (ef_epoll_fd_t *)realloc(ep->fds, sizeof(ef_epoll_fd_t) * fd_cap);
+    if (!fds) {
+        return -1;
+    }
+
+    memset(&fds[ep->fd_cap], 0, sizeof(ef_epoll_fd_t) * (fd_cap - ep->fd_cap));
+    ep->fds = fds;
+    ep->fd_cap = fd_cap;
+    return 0;
+}
+
+EF_POLL_FUNC int ef_epoll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
 {
     ef_epoll_t *ep;
-    epoll_event_t *e;
+    ef_epoll_fd_t *ef;
+    int ret;
 
     /*
      * epoll will not auto dissociate fd after event fired
@@ -45,50 +218,139 @@ static int ef_epoll_associate(ef_poll_t *p, int fd, int events, void *ptr, int f
     }
 
     ep = (ef_epoll_t *)p;
-    e = &ep->events[0];
-    e->events = events;
-    e->data.ptr = ptr;
+    if (fd >= ep->fd_cap && ef_epoll_expand(ep, fd) < 0) {
+        return -1;
+    }
+
+    ef = &ep->fds[fd];
 
-    return epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, e);
+    /*
+     * still registered with the same mask by the same owner, an fd closed
+     * without dissociate and reused goes to the kernel, where MOD falls
+     * back to ADD
+     */
+    if (ef->mask == events && ef->ptr == ptr) {
+        ef->waiting = 1;
+        ++p->ctl_saved;
+        return 0;
+    }
+    ef->ptr = ptr;
+
+#ifdef EF_EPOLL_URING
+    if (ep->ring.fd >= 0) {
+        ret = ef_epoll_queue(ep, ef->mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, events);
+    } else {
+        ret = ef_epoll_ctl(ep, fd, ef->mask, events);
+    }
+#else
+    ret = ef_epoll_ctl(ep, fd, ef->mask, events);
+#endif
+
+    if (ret < 0) {
+        ef->mask = 0;
+        ef->waiting = 0;
+        return ret;
+    }
+
+    ef->mask = events;
+    ef->waiting = 1;
+    return 0;
 }
 
-static int ef_epoll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+EF_POLL_FUNC int ef_epoll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
 {
     ef_epoll_t *ep = (ef_epoll_t *)p;
-    epoll_event_t *e = &ep->events[0];
-    return epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, e);
+    ef_epoll_fd_t *ef;
+
+    if (fd >= ep->fd_cap) {
+        return 0;
+    }
+
+    ef = &ep->fds[fd];
+    ef->waiting = 0;
+    if (!ef->mask) {
+        return 0;
+    }
+
+    /*
+     * keep it registered, the kernel removes it when closed
+     */
+    if (onclose) {
+        ef->mask = 0;
+    }
+    ++p->ctl_saved;
+    return 0;
 }
 
-static int ef_epoll_unset(ef_poll_t *p, int fd, int events)
+EF_POLL_FUNC int ef_epoll_unset(ef_poll_t *p, int fd, int events)
 {
     return 0;
 }
 
-static int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+EF_POLL_FUNC int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
 {
-    int ret, idx;
+    int ret, idx, cnt = 0;
     ef_epoll_t *ep = (ef_epoll_t *)p;
 
     if (count > ep->cap) {
         count = ep->cap;
     }
 
-    ret = epoll_wait(ep->epfd, &ep->events[0], count, millisecs);
+#ifdef EF_EPOLL_URING
+    if (ep->ring.fd >= 0) {
+        cnt = ef_epoll_flush(ep, evts, count);
+        if (cnt > 0) {
+            millisecs = 0;
+        }
+    }
+#endif
+
+    ret = epoll_wait(ep->epfd, &ep->events[0], count - cnt, millisecs);
     if (ret <= 0) {
-        return ret;
+        return cnt > 0 ? cnt : ret;
     }
 
     for (idx = 0; idx < ret; ++idx) {
-        evts[idx].events = ep->events[idx].events;
-        evts[idx].ptr = ep->events[idx].data.ptr;
+        int fd = ep->events[idx].data.fd;
+        ef_epoll_fd_t *ef = &ep->fds[fd];
+
+        /*
+         * nobody waiting, remove it now or level triggered reports it again
+         */
+        if (!ef->waiting) {
+            if (ef->mask) {
+#ifdef EF_EPOLL_URING
+                if (ep->ring.fd >= 0) {
+                    ef_epoll_queue(ep, EPOLL_CTL_DEL, fd, 0);
+                } else {
+                    epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, &ep->events[idx]);
+                }
+#else
+                epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, &ep->events[idx]);
+#endif
+                ef->mask = 0;
+                --p->ctl_saved;
+            }
+            continue;
+        }
+
+        evts[cnt].events = ep->events[idx].events;
+        evts[cnt].ptr = ef->ptr;
+        ++cnt;
     }
-    return ret;
+    return cnt;
 }
 
 static int ef_epoll_free(ef_poll_t *p)
 {
     ef_epoll_t *ep = (ef_epoll_t *)p;
+#ifdef EF_EPOLL_URING
+    if (ep->ring.fd >= 0) {
+        ef_uring_free(&ep->ring);
+    }
+#endif
     close(ep->epfd);
+    free(ep->fds);
     free(ep);
     return 0;
 }
@@ -111,19 +373,50 @@ static ef_poll_t *ef_epoll_create(int cap)
         return NULL;
     }
 
+    /*
+     * the fd table grows on demand
+     */
+    ep->fd_cap = 1024;
+    ep->fds = (ef_epoll_fd_t *)calloc(ep->fd_cap, sizeof(ef_epoll_fd_t));
+    if (!ep->fds) {
+        free(ep);
+        return NULL;
+    }
+
     ep->epfd = epoll_create1(EPOLL_CLOEXEC);
     if (ep->epfd < 0) {
+        free(ep->fds);
         free(ep);
         return NULL;
     }
 
+#ifdef EF_EPOLL_URING
+    /*
+     * fall back to direct epoll_ctl without the ring or the op
+     */
+    if (ef_uring_init(&ep->ring, cap, IORING_SETUP_SINGLE_ISSUER) == 0 && !ef_uring_probe(&ep->ring, IORING_OP_EPOLL_CTL)) {
+        ef_uring_free(&ep->ring);
+    }
+#endif
+
     ep->poll.associate = ef_epoll_associate;
     ep->poll.dissociate = ef_epoll_dissociate;
     ep->poll.unset = ef_epoll_unset;
     ep->poll.wait = ef_epoll_wait;
     ep->poll.free = ef_epoll_free;
+    ep->poll.submit = NULL;
+    ep->poll.ctl_saved = 0;
     ep->cap = cap;
     return &ep->poll;
 }
 
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_epoll_##op
+
+const ef_poll_backend_t ef_poll_backend_epoll = {"epoll", ef_epoll_create};
+
+#ifndef EF_POLL_REGISTRY
 create_func_t ef_create_poll = ef_epoll_create;
+#endif
@@ -19,310 +19,236 @@
 // THE SOFTWARE.
 
 #include "poll.h"
+#include "util/list.h"
+#include "util/util.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
+/*
+ * slots are allocated in chunks and never move, epoll data.ptr
+ * points to the slot of the fd
+ */
+#define EF_EPOLLET_CHUNK_SHIFT 10
+#define EF_EPOLLET_CHUNK_SIZE  (1 << EF_EPOLLET_CHUNK_SHIFT)
+#define EF_EPOLLET_CHUNK_MASK  (EF_EPOLLET_CHUNK_SIZE - 1)
+
+/*
+ * waits served from the ready list alone before the kernel is polled
+ */
+#define EF_EPOLLET_LIST_WAITS 8
+
 typedef struct epoll_event epoll_event_t;
 
-typedef struct _ef_epoll_item {
+/*
+ * fired gathers the edges not consumed yet, the slot is in the ready list
+ * while someone waits and fired has any event waited, errors are always
+ * waited
+ */
+typedef struct _ef_epoll_slot {
     int fd;
+    int registered;
     int waiting;
     int fired;
+    int ready;
     void *ptr;
-} ef_epoll_item_t;
+    ef_list_entry_t ready_entry;
+} ef_epoll_slot_t;
 
 typedef struct _ef_epoll {
     ef_poll_t poll;
     int epfd;
     int cap;
-    int used;
-    int fill;
-    int *index;
-    ef_epoll_item_t *items;
-    epoll_event_t *events;
+    int chunk_cap;
+    ef_epoll_slot_t **chunks;
+    ef_list_entry_t ready_list;
+    int list_waits;
+    epoll_event_t events[0];
 } ef_epoll_t;
 
-static int ef_epoll_expand(ef_epoll_t *ep, int fd)
+static ef_epoll_slot_t *ef_epoll_slot(ef_epoll_t *ep, int fd, int create)
 {
-    int cap;
-    int *index;
-    ef_epoll_item_t *items;
-    epoll_event_t *events;
+    int chunk = fd >> EF_EPOLLET_CHUNK_SHIFT;
+    int chunk_cap = ep->chunk_cap;
+    ef_epoll_slot_t **chunks;
 
-    cap = ep->cap;
-    if (cap > fd) {
-        return 0;
+    if (chunk < ep->chunk_cap && ep->chunks[chunk]) {
+        return &ep->chunks[chunk][fd & EF_EPOLLET_CHUNK_MASK];
     }
 
-    /*
-     * every time multiply 2
-     */
-    while (cap <= fd) {
-        cap <<= 1;
-    }
-
-    index = (int *)realloc(ep->index, sizeof(int) * cap);
-    if (!index) {
-        return -1;
+    if (!create) {
+        return NULL;
     }
 
     /*
-     * set unused area to -1
+     * every time multiply 2
      */
-    memset(index + ep->cap, -1, sizeof(int) * (cap - ep->cap));
-    ep->index = index;
+    if (chunk >= chunk_cap) {
+        while (chunk_cap <= chunk) {
+            chunk_cap <<= 1;
+        }
 
-    items = (ef_epoll_item_t *)realloc(ep->items, sizeof(ef_epoll_item_t) * cap);
-    if (!items) {
-        return -1;
-    }
+        chunks = (ef_epoll_slot_t **)realloc(ep->chunks, sizeof(ef_epoll_slot_t *) * chunk_cap);
+        if (!chunks) {
+            return NULL;
+        }
 
-    ep->items = items;
+        memset(chunks + ep->chunk_cap, 0, sizeof(ef_epoll_slot_t *) * (chunk_cap - ep->chunk_cap));
+        ep->chunks = chunks;
+        ep->chunk_cap = chunk_cap;
+    }
 
-    events = (epoll_event_t *)realloc(ep->events, sizeof(epoll_event_t) * cap);
-    if (!events) {
-        return -1;
+    ep->chunks[chunk] = (ef_epoll_slot_t *)calloc(EF_EPOLLET_CHUNK_SIZE, sizeof(ef_epoll_slot_t));
+    if (!ep->chunks[chunk]) {
+        return NULL;
     }
+    return &ep->chunks[chunk][fd & EF_EPOLLET_CHUNK_MASK];
+}
 
-    ep->events = events;
+static inline int ef_epoll_ready_events(ef_epoll_slot_t *ps)
+{
+    return (ps->waiting | EPOLLERR | EPOLLHUP) & ps->fired;
+}
 
-    /*
-     * update cap to the new
-     */
-    ep->cap = cap;
+/*
+ * join or leave the ready list by the events fired and waited, a hung up
+ * fd nobody waits on must stay out, or the list never empties and the
+ * kernel is never polled again
+ */
+static inline void ef_epoll_update(ef_epoll_t *ep, ef_epoll_slot_t *ps)
+{
+    int ready = ps->waiting && ef_epoll_ready_events(ps) != 0;
 
-    return 0;
+    if (ready && !ps->ready) {
+        ef_list_insert_before(&ep->ready_list, &ps->ready_entry);
+    } else if (!ready && ps->ready) {
+        ef_list_remove(&ps->ready_entry);
+    }
+    ps->ready = ready;
 }
 
-static int ef_epoll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+EF_POLL_FUNC int ef_epoll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
 {
-    ef_epoll_t *ep;
-    ef_epoll_item_t *pi, tmp;
-    epoll_event_t *e;
-    int idx;
-
-    ep = (ef_epoll_t *)p;
+    ef_epoll_t *ep = (ef_epoll_t *)p;
+    ef_epoll_slot_t *ps;
+    epoll_event_t e;
 
-    if (fd >= ep->cap && ef_epoll_expand(ep, fd) < 0) {
+    ps = ef_epoll_slot(ep, fd, 1);
+    if (!ps) {
         return -1;
     }
 
-    idx = ep->index[fd];
-    if (idx < 0) {
-        idx = ep->used++;
-        ep->index[fd] = idx;
-
-        pi = &ep->items[idx];
-        pi->fd = fd;
-        pi->waiting = events;
-        pi->fired = EPOLLOUT;
-        pi->ptr = ptr;
-
-        e = &ep->events[0];
-        e->events = EPOLLIN | EPOLLOUT | EPOLLET;
-        e->data.fd = fd;
-
-        if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, e) < 0) {
-            return -1;
-        }
-    } else {
-        pi = &ep->items[idx];
-        pi->waiting = events;
-        pi->ptr = ptr;
-    }
+    ps->waiting = events;
+    ps->ptr = ptr;
 
     /*
-     * move to filled area
+     * registered once for both directions, a new fd is writable
      */
-    if ((pi->waiting | EPOLLERR | EPOLLHUP) & pi->fired) {
-        if (idx > ep->fill) {
-            ep->index[ep->items[ep->fill].fd] = idx;
-            ep->index[pi->fd] = ep->fill;
-
-            tmp = ep->items[ep->fill];
-            ep->items[ep->fill] = *pi;
-            *pi = tmp;
-        }
-        if (idx >= ep->fill) {
-            ++ep->fill;
+    if (!ps->registered) {
+        ps->fd = fd;
+        ps->fired = EPOLLOUT;
+
+        e.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        e.data.ptr = ps;
+        if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+            ps->waiting = 0;
+            return -1;
         }
-        return 1;
+        ps->registered = 1;
     }
 
-    return 0;
+    ef_epoll_update(ep, ps);
+    return ps->ready;
 }
 
-static int ef_epoll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+EF_POLL_FUNC int ef_epoll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
 {
-    ef_epoll_t *ep;
-    ef_epoll_item_t *pi, tmp;
-    epoll_event_t *e;
-    int idx;
-
-    ep = (ef_epoll_t *)p;
+    ef_epoll_t *ep = (ef_epoll_t *)p;
+    ef_epoll_slot_t *ps;
+    epoll_event_t e;
 
-    if (fd >= ep->cap) {
+    ps = ef_epoll_slot(ep, fd, 0);
+    if (!ps || !ps->registered) {
         return 0;
     }
 
-    idx = ep->index[fd];
-    if (idx < 0) {
+    ps->waiting = 0;
+    if (!onclose) {
+        ef_epoll_update(ep, ps);
         return 0;
     }
 
-    pi = &ep->items[idx];
-
-    if (onclose) {
-
-        /*
-         * set index to -1
-         */
-        ep->index[fd] = -1;
-
-        /*
-         * remove from filled if inside of
-         */
-        if (idx < ep->fill) {
-            --ep->fill;
-            if (idx < ep->fill) {
-                *pi = ep->items[ep->fill];
-                ep->index[pi->fd] = idx;
-                idx = ep->fill;
-                pi = &ep->items[idx];
-            }
-        }
-
-        /*
-         * remove from used
-         */
-        --ep->used;
-        if (idx < ep->used) {
-            *pi = ep->items[ep->used];
-            ep->index[pi->fd] = idx;
-        }
-
-        /*
-         * delete from epoll
-         */
-        e = &ep->events[0];
-        return epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, e);
-    } else {
-        pi->waiting = 0;
-
-        /*
-         * remove from filled
-         */
-        if (idx < ep->fill) {
-            --ep->fill;
-            if (idx < ep->fill) {
-                ep->index[ep->items[ep->fill].fd] = idx;
-                ep->index[pi->fd] = ep->fill;
-
-                tmp = ep->items[ep->fill];
-                ep->items[ep->fill] = *pi;
-                *pi = tmp;
-            }
-        }
-    }
-
-    return 0;
+    /*
+     * forget the edges, the fd may be reused
+     */
+    ps->fired = 0;
+    ps->registered = 0;
+    ef_epoll_update(ep, ps);
+    return epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, &e);
 }
 
-static int ef_epoll_unset(ef_poll_t *p, int fd, int events)
+EF_POLL_FUNC int ef_epoll_unset(ef_poll_t *p, int fd, int events)
 {
-    ef_epoll_t *ep;
-    ef_epoll_item_t *pi, tmp;
-    int idx;
-
-    ep = (ef_epoll_t *)p;
-
-    if (fd >= ep->cap) {
-        return 0;
-    }
+    ef_epoll_t *ep = (ef_epoll_t *)p;
+    ef_epoll_slot_t *ps;
 
-    idx = ep->index[fd];
-    if (idx < 0) {
+    ps = ef_epoll_slot(ep, fd, 0);
+    if (!ps || !ps->registered) {
         return 0;
     }
 
-    pi = &ep->items[idx];
-    pi->fired &= (~events);
-
-    /*
-     * remove from filled
-     */
-    if (idx < ep->fill && !((pi->waiting | EPOLLERR | EPOLLHUP) & pi->fired)) {
-        --ep->fill;
-        if (idx < ep->fill) {
-            ep->index[ep->items[ep->fill].fd] = idx;
-            ep->index[pi->fd] = ep->fill;
-
-            tmp = ep->items[ep->fill];
-            ep->items[ep->fill] = *pi;
-            *pi = tmp;
-        }
-    }
-
+    ps->fired &= (~events);
+    ef_epoll_update(ep, ps);
     return 0;
 }
 
-static int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+EF_POLL_FUNC int ef_epoll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
 {
-    int ret, cur, idx;
-    ef_epoll_t *ep;
-    ef_epoll_item_t *pi, tmp;
-
-    ep = (ef_epoll_t *)p;
+    ef_epoll_t *ep = (ef_epoll_t *)p;
+    ef_list_entry_t *ent;
+    int ret, idx, cnt = 0;
 
-    if (!ep->fill) {
-        ret = epoll_wait(ep->epfd, ep->events, ep->cap, millisecs);
+    /*
+     * the ones still ready are reported first, the kernel is polled
+     * without blocking every EF_EPOLLET_LIST_WAITS of them, so a listener
+     * kept ready by the accept budget can not hide the edges of other fds
+     */
+    if (ef_list_empty(&ep->ready_list) || ++ep->list_waits >= EF_EPOLLET_LIST_WAITS) {
+        ep->list_waits = 0;
+        ret = epoll_wait(ep->epfd, &ep->events[0], ep->cap, ef_list_empty(&ep->ready_list) ? millisecs : 0);
         if (ret < 0) {
             return ret;
         }
 
-        for (cur = 0; cur < ret; ++cur) {
-            idx = ep->index[ep->events[cur].data.fd];
-            pi = &ep->items[idx];
-            pi->fired |= ep->events[cur].events;
-
-            /*
-             * move to filled area
-             */
-            if (idx >= ep->fill && ((pi->waiting | EPOLLERR | EPOLLHUP) & pi->fired)) {
-                if (idx > ep->fill) {
-                    ep->index[ep->items[ep->fill].fd] = idx;
-                    ep->index[pi->fd] = ep->fill;
-
-                    tmp = ep->items[ep->fill];
-                    ep->items[ep->fill] = *pi;
-                    *pi = tmp;
-                }
-                ++ep->fill;
-            }
+        for (idx = 0; idx < ret; ++idx) {
+            ef_epoll_slot_t *ps = (ef_epoll_slot_t *)ep->events[idx].data.ptr;
+            ps->fired |= ep->events[idx].events;
+            ef_epoll_update(ep, ps);
         }
     }
 
-    if (count > ep->fill) {
-        count = ep->fill;
-    }
-
-    for (idx = 0; idx < count; ++idx) {
-        pi = &ep->items[idx];
-        evts[idx].events = ((pi->waiting | EPOLLERR | EPOLLHUP) & pi->fired);
-        evts[idx].ptr = pi->ptr;
+    ent = ef_list_entry_after(&ep->ready_list);
+    while (cnt < count && ent != &ep->ready_list) {
+        ef_epoll_slot_t *ps = CAST_PARENT_PTR(ent, ef_epoll_slot_t, ready_entry);
+        evts[cnt].events = ef_epoll_ready_events(ps);
+        evts[cnt].ptr = ps->ptr;
+        ++cnt;
+        ent = ef_list_entry_after(ent);
     }
-    return count;
+    return cnt;
 }
 
 static int ef_epoll_free(ef_poll_t *p)
 {
     ef_epoll_t *ep = (ef_epoll_t *)p;
+    int chunk;
+
     close(ep->epfd);
-    free(ep->events);
-    free(ep->items);
-    free(ep->index);
+    for (chunk = 0; chunk < ep->chunk_cap; ++chunk) {
+        free(ep->chunks[chunk]);
+    }
+    free(ep->chunks);
     free(ep);
     return 0;
 }
@@ -330,66 +256,55 @@ static int ef_epoll_free(ef_poll_t *p)
 static ef_poll_t *ef_epoll_create(int cap)
 {
     ef_epoll_t *ep;
-    size_t size;
+    size_t size = sizeof(ef_epoll_t);
 
     /*
-     * event buffer at least 128
+     * event buffer at least 128, edges not fetched stay in the kernel
      */
     if (cap < 128) {
         cap = 128;
     }
 
-    ep = (ef_epoll_t *)calloc(1, sizeof(ef_epoll_t));
+    size += sizeof(epoll_event_t) * cap;
+    ep = (ef_epoll_t *)malloc(size);
     if (!ep) {
         return NULL;
     }
 
-    size = sizeof(int) * cap;
-    ep->index = (int *)malloc(size);
-    if (!ep->index) {
-        goto error_exit;
-    }
-    memset(ep->index, -1, size);
-
-    ep->items = (ef_epoll_item_t *)malloc(sizeof(ef_epoll_item_t) * cap);
-    if (!ep->items) {
-        goto error_exit;
-    }
-
-    ep->events = (epoll_event_t *)malloc(sizeof(epoll_event_t) * cap);
-    if (!ep->events) {
-        goto error_exit;
+    ep->chunk_cap = 1;
+    ep->chunks = (ef_epoll_slot_t **)calloc(ep->chunk_cap, sizeof(ef_epoll_slot_t *));
+    if (!ep->chunks) {
+        free(ep);
+        return NULL;
     }
 
     ep->epfd = epoll_create1(EPOLL_CLOEXEC);
     if (ep->epfd < 0) {
-        goto error_exit;
+        free(ep->chunks);
+        free(ep);
+        return NULL;
     }
 
+    ef_list_init(&ep->ready_list);
     ep->poll.associate = ef_epoll_associate;
     ep->poll.dissociate = ef_epoll_dissociate;
     ep->poll.unset = ef_epoll_unset;
     ep->poll.wait = ef_epoll_wait;
     ep->poll.free = ef_epoll_free;
+    ep->poll.submit = NULL;
+    ep->poll.ctl_saved = 0;
     ep->cap = cap;
-    ep->used = 0;
-    ep->fill = 0;
+    ep->list_waits = 0;
     return &ep->poll;
+}
 
-error_exit:
-
-    if (ep->index) {
-        free(ep->index);
-    }
-    if (ep->items) {
-        free(ep->items);
-    }
-    if (ep->events) {
-        free(ep->events);
-    }
-    free(ep);
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_epoll_##op
 
-    return NULL;
-}
+const ef_poll_backend_t ef_poll_backend_epollet = {"epollet", ef_epoll_create};
 
+#ifndef EF_POLL_REGISTRY
 create_func_t ef_create_poll = ef_epoll_create;
+#endif
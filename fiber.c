@@ -19,6 +19,7 @@
 // THE SOFTWARE.
 
 #include <unistd.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <signal.h>
 #include "fiber.h"
@@ -68,7 +69,12 @@ ef_fiber_t *ef_fiber_create(ef_fiber_sched_t *rt, size_t stack_size, size_t head
     fiber = (ef_fiber_t*)((char *)stack + stack_size - header_size);
     fiber->stack_size = stack_size;
     fiber->stack_area = stack;
-    fiber->stack_upper = (char *)stack + stack_size - header_size;
+
+    /*
+     * the fiber proc gets a 16 bytes aligned stack as the abi requires only
+     * when stack_upper is 8 bytes below a 16 bytes boundary, not depend on header_size
+     */
+    fiber->stack_upper = (char *)(((uintptr_t)fiber & ~(uintptr_t)15) - 8);
     fiber->stack_lower = (char *)stack + stack_size - page_size;
     fiber->sched = rt;
     ef_fiber_init(fiber, fiber_proc, param);
@@ -18,6 +18,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#define _GNU_SOURCE
+
 #include "framework.h"
 #include "coroutine.h"
 #include "util/list.h"
@@ -25,18 +27,82 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#endif
+
+/*
+ * built with EF_POLL_INLINE naming a backend source, like '"epoll.c"',
+ * the backend is compiled in here and its ops are called directly
+ * where the compiler can inline them, link no backend then
+ */
+#ifdef EF_POLL_INLINE
+#include EF_POLL_INLINE
+#define ef_poll_call(p, op, ...) EF_POLL_OPS(op)(p, __VA_ARGS__)
+#else
+#define ef_poll_call(p, op, ...) (p)->op(p, __VA_ARGS__)
+#endif
+
+/*
+ * built with EF_LOOPBACK the socket calls go to the in-memory sockets
+ * of loopback.c, other fds are passed to the system
+ */
+#ifdef EF_LOOPBACK
+#define EF_LOOPBACK_SHIM
+#include "loopback.h"
+#endif
 
 /*
  * the global pointer
  */
 ef_runtime_t *ef_runtime = NULL;
 
-inline int ef_queue_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd) __attribute__((always_inline));
-inline int ef_routine_run(ef_runtime_t *rt, ef_routine_proc_t proc, int socket) __attribute__((always_inline));
+#ifndef __linux__
+/*
+ * the write end of the self pipe, for the signal handler
+ */
+static int ef_signal_pipe = -1;
+#endif
+
+inline int ef_accept_fd(int socket) __attribute__((always_inline));
+inline void ef_queue_fd(ef_listen_info_t *li, int fd, long now) __attribute__((always_inline));
+inline int ef_dequeue_fd(ef_listen_info_t *li) __attribute__((always_inline));
+inline int ef_defer_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd) __attribute__((always_inline));
+inline int ef_codel_drop(ef_listen_info_t *li, long now) __attribute__((always_inline));
+inline int ef_routine_run(ef_runtime_t *rt, ef_listen_info_t *li, int socket) __attribute__((always_inline));
+inline void ef_routine_ready(ef_routine_t *er) __attribute__((always_inline));
+inline void ef_sched_init(ef_sched_class_t *sc, int weight) __attribute__((always_inline));
+inline void ef_dispatch_queue(ef_runtime_t *rt, long now) __attribute__((always_inline));
+inline void ef_resume_ready(ef_runtime_t *rt) __attribute__((always_inline));
+inline int ef_queue_runnable(ef_runtime_t *rt) __attribute__((always_inline));
+inline void ef_post_drain(ef_runtime_t *rt, int fired) __attribute__((always_inline));
+inline void ef_post_stop(ef_runtime_t *rt) __attribute__((always_inline));
+inline void ef_timer_add(ef_runtime_t *rt, ef_routine_t *er, long expire) __attribute__((always_inline));
+inline void ef_timer_fire(ef_runtime_t *rt, long now) __attribute__((always_inline));
+inline void ef_signal_drain(ef_runtime_t *rt, long now) __attribute__((always_inline));
+inline long ef_routine_wait_io(ef_routine_t *er) __attribute__((always_inline));
+inline long ef_routine_submit(ef_routine_t *er, int op, int fd, void *buf, size_t len, int flags) __attribute__((always_inline));
+inline int ef_listen_poll(ef_runtime_t *rt, ef_listen_info_t *li) __attribute__((always_inline));
+inline void ef_busy_adapt(ef_runtime_t *rt, long gap) __attribute__((always_inline));
+inline int ef_busy_wait(ef_runtime_t *rt, ef_event_t *evts, int count, int timeout) __attribute__((always_inline));
+inline void ef_listen_accepted(ef_runtime_t *rt, ef_listen_info_t *li, int socket, long now, int *exhausted) __attribute__((always_inline));
+inline void ef_routine_flush_pending(ef_routine_t *er) __attribute__((always_inline));
+
+ssize_t ef_output_flush(ef_routine_t *er, const struct iovec *iov, int iovcnt);
+ssize_t ef_output_write(ef_routine_t *er, const struct iovec *iov, int iovcnt);
+void ef_output_release(ef_routine_t *er);
+ssize_t ef_splice_copy(ef_routine_t *er, int in_fd, int out_fd, size_t len);
+void ef_splice_release(ef_runtime_t *rt, int *pfd);
+void ef_routine_notsock(ef_routine_t *er, int fd);
 
 long ef_proc(void *param)
 {
@@ -52,11 +118,83 @@ long ef_proc(void *param)
      * it may or may not closed by the user code
      */
     ef_routine_close(er, fd);
+    ef_output_release(er);
 
+    --er->sched->count;
     return retval;
 }
 
-inline int ef_routine_run(ef_runtime_t *rt, ef_routine_proc_t proc, int socket)
+long ef_spawn_proc(void *param)
+{
+    ef_routine_t *er = (ef_routine_t*)param;
+
+    er->retval = er->spawn_proc(er->spawn_arg, er);
+    ef_output_release(er);
+
+    /*
+     * nobody will join a cancelled routine unless already joining
+     */
+    if (er->detached || (er->cancelled && !er->joiner)) {
+        --er->sched->count;
+        return er->retval;
+    }
+
+    if (er->joiner) {
+        ef_routine_wake(er->joiner);
+    }
+
+    /*
+     * keep the routine until joined, it may be reused once exited
+     */
+    er->status = ROUTINE_STATUS_EXITED;
+    ef_fiber_yield(er->co.fiber.sched, 0);
+
+    --er->sched->count;
+    return er->retval;
+}
+
+inline void ef_sched_init(ef_sched_class_t *sc, int weight)
+{
+    sc->weight = weight;
+    sc->deficit = 0;
+    sc->active = 0;
+    sc->count = 0;
+    ef_list_init(&sc->ready_list);
+    sc->resumed = 0;
+    sc->ready_wait_total = 0;
+    sc->ready_wait_max = 0;
+}
+
+inline void ef_routine_ready(ef_routine_t *er)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    ef_sched_class_t *sc = er->sched;
+
+    er->status = ROUTINE_STATUS_READY;
+    er->ready_time = rt->now;
+    ef_list_insert_before(&sc->ready_list, &er->ready_entry);
+
+    /*
+     * the class joins the round when it has the first ready routine
+     */
+    if (!sc->active) {
+        sc->active = 1;
+        ef_list_insert_before(&rt->active_list, &sc->active_entry);
+    }
+}
+
+/*
+ * write out the buffered output before the routine gives up the cpu,
+ * not again while doing so
+ */
+inline void ef_routine_flush_pending(ef_routine_t *er)
+{
+    if (er->output && er->output->len && !er->output->flushing) {
+        ef_routine_flush(er);
+    }
+}
+
+inline int ef_routine_run(ef_runtime_t *rt, ef_listen_info_t *li, int socket)
 {
     ef_routine_t *er = (ef_routine_t*)ef_coroutine_create(&rt->co_pool, sizeof(ef_routine_t), ef_proc, NULL);
     if (er) {
@@ -64,299 +202,1548 @@ inline int ef_routine_run(ef_runtime_t *rt, ef_routine_proc_t proc, int socket)
         er->poll_data.fd = socket;
         er->poll_data.routine_ptr = er;
         er->poll_data.runtime_ptr = rt;
-        er->poll_data.ef_proc = proc;
+        er->poll_data.ef_proc = li->ef_proc;
+        er->status = ROUTINE_STATUS_RUNNING;
+        er->sched = &li->sched;
+        ++li->sched.count;
+        er->spawn_proc = NULL;
+        er->detached = 0;
+        er->joiner = NULL;
+        er->cancelled = rt->cancelled;
+        er->output = NULL;
+        er->notsock_fd = -1;
         ef_coroutine_resume(&rt->co_pool, &er->co, 0);
         return 0;
     }
     return -1;
 }
 
-inline int ef_queue_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd)
+inline int ef_accept_fd(int socket)
 {
-    ef_queue_fd_t *qf;
-    int retval, flags;
-
-    flags = fcntl(fd, F_GETFL);
-    if (!(flags & O_NONBLOCK)) {
-        retval = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-        if (retval < 0) {
-            return retval;
-        }
-    }
-
-    if (!ef_list_empty(&rt->free_fd_list)) {
-        qf = CAST_PARENT_PTR(ef_list_remove_after(&rt->free_fd_list), ef_queue_fd_t, list_entry);
-    } else {
-        qf = (ef_queue_fd_t*)malloc(sizeof(ef_queue_fd_t));
+#ifdef __linux__
+    return accept4(socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd, flags;
+
+    fd = accept(socket, NULL, NULL);
+    if (fd < 0) {
+        return fd;
     }
 
     /*
-     * close the new connection when no memory
+     * bsd derived systems inherit O_NONBLOCK from the listen socket
      */
-    if (!qf) {
+    flags = fcntl(fd, F_GETFL);
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
         close(fd);
+        errno = ECONNABORTED;
         return -1;
     }
-
-    qf->fd = fd;
-    ef_list_insert_before(&li->fd_list, &qf->list_entry);
-
-    return 0;
+    return fd;
+#endif
 }
 
-int ef_init(ef_runtime_t *rt, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink)
+inline void ef_queue_fd(ef_listen_info_t *li, int fd, long now)
 {
-    ef_poll_t *p = ef_create_poll(1024);
-    if (!p) {
-        return -1;
+    int tail = li->ring_head + li->stat.queue_depth;
+    if (tail >= li->opts.queue_limit) {
+        tail -= li->opts.queue_limit;
     }
 
     /*
-     * the global pointer
+     * the caller ensures the ring is not full
      */
-    ef_runtime = rt;
-
-    rt->p = p;
-    rt->stopping = 0;
-    rt->shrink_millisecs = shrink_millisecs;
-    rt->count_per_shrink = count_per_shrink;
+    li->fd_ring[tail].fd = fd;
+    li->fd_ring[tail].enqueue_time = now;
+    ++li->stat.queue_depth;
+}
 
-    if (ef_coroutine_pool_init(&rt->co_pool, stack_size, limit_min, limit_max) < 0) {
-        return -1;
+inline int ef_dequeue_fd(ef_listen_info_t *li)
+{
+    int fd = li->fd_ring[li->ring_head].fd;
+    if (++li->ring_head >= li->opts.queue_limit) {
+        li->ring_head = 0;
     }
-    ef_list_init(&rt->listen_list);
-    ef_list_init(&rt->free_fd_list);
-
-    return 0;
+    --li->stat.queue_depth;
+    return fd;
 }
 
-int ef_add_listen(ef_runtime_t *rt, int socket, ef_routine_proc_t proc)
+inline int ef_defer_fd(ef_runtime_t *rt, ef_listen_info_t *li, int fd)
 {
+    ef_defer_fd_t *df;
+
+    if (!ef_list_empty(&rt->free_defer_list)) {
+        df = CAST_PARENT_PTR(ef_list_remove_after(&rt->free_defer_list), ef_defer_fd_t, list_entry);
+    } else {
+        df = (ef_defer_fd_t*)malloc(sizeof(ef_defer_fd_t));
+    }
+
     /*
-     * set the listen socket in non-block mode
+     * close the new connection when no memory
      */
-    int retval = fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
-    if (retval < 0) {
-        return retval;
+    if (!df) {
+        close(fd);
+        return -1;
     }
 
-    ef_listen_info_t *li = (ef_listen_info_t*)malloc(sizeof(ef_listen_info_t));
-    if (li == NULL) {
+    df->poll_data.type = FD_TYPE_DEFER;
+    df->poll_data.fd = fd;
+    df->poll_data.routine_ptr = NULL;
+    df->poll_data.runtime_ptr = rt;
+    df->poll_data.ef_proc = li->ef_proc;
+    df->listen_info = li;
+
+    if (ef_poll_call(rt->p, associate, fd, EF_POLLIN, &df->poll_data, 0) < 0) {
+        ef_list_insert_after(&rt->free_defer_list, &df->list_entry);
+        close(fd);
         return -1;
     }
 
-    li->poll_data.type = FD_TYPE_LISTEN;
-    li->poll_data.fd = socket;
-    li->poll_data.routine_ptr = NULL;
-    li->poll_data.runtime_ptr = rt;
-    li->ef_proc = proc;
+    ef_list_insert_before(&li->defer_list, &df->list_entry);
+    ++li->stat.defer_count;
+    return 0;
+}
 
-    ef_list_init(&li->fd_list);
-    ef_list_insert_after(&rt->listen_list, &li->list_entry);
+long ef_codel_interval(long interval, int count)
+{
+    long root = 1;
 
-    return 0;
+    /*
+     * interval / sqrt(count), integer sqrt is enough here
+     */
+    while ((root + 1) * (root + 1) <= count) {
+        ++root;
+    }
+    return interval / root;
 }
 
-int ef_run_loop(ef_runtime_t *rt)
+inline int ef_codel_drop(ef_listen_info_t *li, long now)
 {
-    ef_event_t evts[1024];
+    ef_queue_fd_t *qf = &li->fd_ring[li->ring_head];
+    long interval = li->opts.interval_millisecs;
 
     /*
-     * add all listen socket fds to poll object
+     * the queue delay of the head is fine, leave the dropping state
      */
-    ef_list_entry_t *ent = ef_list_entry_after(&rt->listen_list);
-    while (ent != &rt->listen_list) {
-        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
-        int ret = rt->p->associate(rt->p, li->poll_data.fd, EF_POLLIN, &li->poll_data, 0);
-        if (ret < 0) {
-            return ret;
-        }
-        ent = ef_list_entry_after(ent);
+    if (now - qf->enqueue_time < li->opts.target_millisecs) {
+        li->first_above_time = 0;
+        li->dropping = 0;
+        return 0;
+    }
+
+    if (li->first_above_time == 0) {
+        li->first_above_time = now + interval;
+        return 0;
+    }
+
+    if (now < li->first_above_time) {
+        return 0;
     }
 
     /*
-     * the main event loop
+     * above target for an interval, drop one and schedule the next drop,
+     * drop faster and faster while staying above target
      */
-    while (1) {
-        int cnt = rt->p->wait(rt->p, &evts[0], 1024, 1000);
-        if (cnt < 0 && errno != EINTR) {
-            return cnt;
+    if (!li->dropping) {
+        li->dropping = 1;
+        if (li->drop_count > 2 && now - li->drop_next < 16 * interval) {
+            li->drop_count -= 2;
+        } else {
+            li->drop_count = 1;
         }
+        li->drop_next = now + ef_codel_interval(interval, li->drop_count);
+        return 1;
+    }
 
-        /*
-         * check all events returned by poll wait function
-         */
-        for (int i = 0; i < cnt; ++i) {
-            ef_poll_data_t *ed = (ef_poll_data_t*)evts[i].ptr;
-            if (ed->type == FD_TYPE_LISTEN) {
-                while (1) {
-                    int socket = accept(ed->fd, NULL, NULL);
-                    if (socket < 0) {
-                        rt->p->unset(rt->p, ed->fd, EF_POLLIN);
-                        break;
-                    }
-                    ef_listen_info_t *li = CAST_PARENT_PTR(ed, ef_listen_info_t, poll_data);
+    if (now >= li->drop_next) {
+        ++li->drop_count;
+        li->drop_next += ef_codel_interval(interval, li->drop_count);
+        return 1;
+    }
 
-                    /*
-                     * put new connection to queue
-                     */
-                    int ret = ef_queue_fd(rt, li, socket);
-                    if (ret < 0) {
-                        break;
-                    }
-                }
+    return 0;
+}
 
-                /*
-                 * solaris event port will auto dissociate fd after event fired
-                 */
-                rt->p->associate(rt->p, ed->fd, EF_POLLIN, ed, 1);
-            } else if (ed->type == FD_TYPE_RWC) {
-                ef_coroutine_resume(&rt->co_pool, &ed->routine_ptr->co, evts[i].events);
-            }
-        }
+inline void ef_dispatch_queue(ef_runtime_t *rt, long now)
+{
+    ef_list_entry_t *ent;
+    int pending = 1;
 
-        /*
-         * handle queued connections
-         */
+    /*
+     * every round a busy listener dispatches weight connections,
+     * until the queues drained or the pool exhausted
+     */
+    while (pending) {
+        pending = 0;
         ent = ef_list_entry_after(&rt->listen_list);
-
-        /*
-         * every listening sockets
-         */
         while (ent != &rt->listen_list) {
 
             ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
-            ef_list_entry_t *enf = ef_list_entry_after(&li->fd_list);
+            ent = ef_list_entry_after(ent);
 
-            /*
-             * every queued connection
-             */
-            while (enf != &li->fd_list) {
+            if (li->stat.queue_depth == 0) {
+                li->deficit = 0;
+                continue;
+            }
+
+            if (li->deficit <= 0) {
+                li->deficit += li->opts.weight;
+            }
 
-                ef_queue_fd_t *qf = CAST_PARENT_PTR(enf, ef_queue_fd_t, list_entry);
-                enf = ef_list_entry_after(enf);
+            while (li->deficit > 0 && li->stat.queue_depth > 0) {
+                ef_queue_fd_t *qf = &li->fd_ring[li->ring_head];
+                long wait = now - qf->enqueue_time;
 
-                int ret = ef_routine_run(rt, li->ef_proc, qf->fd);
-                if (ret < 0) {
-                    goto exit_queue;
-                } else {
-                    ef_list_remove(&qf->list_entry);
-                    ef_list_insert_after(&rt->free_fd_list, &qf->list_entry);
+                /*
+                 * start from this listener next time, with the deficit left
+                 */
+                if (ef_routine_run(rt, li, qf->fd) < 0) {
+                    ef_list_remove(&li->list_entry);
+                    ef_list_insert_after(&rt->listen_list, &li->list_entry);
+                    return;
+                }
+
+                ef_dequeue_fd(li);
+                --li->deficit;
+                ++li->stat.dispatched;
+                li->stat.queue_wait_total += wait;
+                if (wait > li->stat.queue_wait_max) {
+                    li->stat.queue_wait_max = wait;
                 }
             }
-            ent = ef_list_entry_after(ent);
+
+            if (li->stat.queue_depth > 0) {
+                pending = 1;
+            }
         }
+    }
+}
 
-exit_queue:
-        if (rt->stopping) {
+inline int ef_queue_runnable(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent;
 
-            /*
-             * close all listening socket
-             */
-            if (!ef_list_empty(&rt->listen_list)) {
+    if (rt->co_pool.free_count == 0 && rt->co_pool.full_count >= rt->co_pool.limit_max) {
+        return 0;
+    }
 
-                ent = ef_list_entry_after(&rt->listen_list);
+    ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list) {
+        if (CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry)->stat.queue_depth > 0) {
+            return 1;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+    return 0;
+}
 
-                while (ent != &rt->listen_list) {
+inline void ef_resume_ready(ef_runtime_t *rt)
+{
+    int budget = rt->ready_budget;
 
-                    ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
-                    ent = ef_list_entry_after(ent);
+    /*
+     * the budget keeps io events served in time, every class resumes
+     * up to weight routines in turn, the one out of budget goes on next time
+     */
+    while (budget > 0 && !ef_list_empty(&rt->active_list)) {
+        ef_sched_class_t *sc = CAST_PARENT_PTR(ef_list_entry_after(&rt->active_list), ef_sched_class_t, active_entry);
 
-                    /*
-                     * close listening socket
-                     */
-                    if (li->poll_data.fd >= 0) {
-                        rt->p->dissociate(rt->p, li->poll_data.fd, 0, 0);
-                        close(li->poll_data.fd);
-                        li->poll_data.fd = -1;
-                    }
+        if (sc->deficit <= 0) {
+            sc->deficit += sc->weight;
+        }
 
-                    /*
-                     * free listen info if connection queue empty
-                     */
-                    if (ef_list_empty(&li->fd_list)) {
-                        ef_list_remove(&li->list_entry);
-                        free(li);
-                    }
-                }
-            }
+        while (sc->deficit > 0 && budget > 0 && !ef_list_empty(&sc->ready_list)) {
+            ef_routine_t *er = CAST_PARENT_PTR(ef_list_remove_after(&sc->ready_list), ef_routine_t, ready_entry);
+            long wait = rt->now - er->ready_time;
 
-            /*
-             * destroy the unused fd queue item
-             */
-            if (!ef_list_empty(&rt->free_fd_list)) {
-                ent = ef_list_remove_after(&rt->free_fd_list);
-                while (ent != NULL) {
-                    ef_queue_fd_t *qf = CAST_PARENT_PTR(ent, ef_queue_fd_t, list_entry);
-                    ent = ef_list_remove_after(&rt->free_fd_list);
-                    free(qf);
-                }
+            --sc->deficit;
+            --budget;
+            ++sc->resumed;
+            sc->ready_wait_total += wait;
+            if (wait > sc->ready_wait_max) {
+                sc->ready_wait_max = wait;
             }
 
-            /*
-             * shrink coroutine pool, to free
-             */
-            if (rt->co_pool.free_count == rt->co_pool.full_count) {
-                rt->p->free(rt->p);
-                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.full_count);
-                break;
-            } else {
-                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.free_count);
-            }
+            er->status = ROUTINE_STATUS_RUNNING;
+            ef_coroutine_resume(&rt->co_pool, &er->co, er->cancelled ? EF_POLLERR : 0);
         }
 
-        if (rt->co_pool.free_count > 0 && rt->co_pool.full_count > rt->co_pool.limit_min) {
-            ef_coroutine_pool_shrink(&rt->co_pool, rt->shrink_millisecs, rt->count_per_shrink);
+        /*
+         * routines resumed above may make the class ready again
+         */
+        ef_list_remove(&sc->active_entry);
+        if (ef_list_empty(&sc->ready_list)) {
+            sc->active = 0;
+            sc->deficit = 0;
+        } else if (sc->deficit > 0) {
+            ef_list_insert_after(&rt->active_list, &sc->active_entry);
+        } else {
+            ef_list_insert_before(&rt->active_list, &sc->active_entry);
         }
     }
-    return 0;
 }
 
-int ef_routine_close(ef_routine_t *er, int fd)
+void ef_reject_fd(ef_runtime_t *rt, int fd)
 {
-    if (er == NULL) {
-        er = ef_routine_current();
-    }
-
     /*
-     * dissociate fd before close
+     * reset the connection so the client fails fast
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 0, 1);
-
-    return close(fd);
+    struct linger lg = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    ef_poll_call(rt->p, dissociate, fd, 0, 1);
+    close(fd);
 }
 
-int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+/*
+ * completion based backends keep accepting and report every fd
+ */
+inline int ef_listen_poll(ef_runtime_t *rt, ef_listen_info_t *li)
 {
-    int retval, flags, error = 0;
-    long events;
-
-    if (er == NULL) {
-        er = ef_routine_current();
+    if (rt->p->submit) {
+        return rt->p->submit(rt->p, EF_OP_ACCEPT, li->poll_data.fd, NULL, 0, 0, &li->poll_data);
     }
+    return ef_poll_call(rt->p, associate, li->poll_data.fd, EF_POLLIN, &li->poll_data, 0);
+}
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = sockfd;
+/*
+ * hand the accepted connection to a routine, or the queue
+ */
+inline void ef_listen_accepted(ef_runtime_t *rt, ef_listen_info_t *li, int socket, long now, int *exhausted)
+{
+    ++li->stat.accepted;
 
     /*
-     * set non-block mode if needed
+     * the number may be left registered by an fd closed without
+     * ef_routine_close, the backend must not take it for this one
      */
-    flags = fcntl(sockfd, F_GETFL);
-    if (!(flags & O_NONBLOCK)) {
-        retval = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-        if (retval < 0) {
-            error = errno;
-            goto exit_conn;
-        }
+    ef_poll_call(rt->p, dissociate, socket, 1, 1);
+
+#ifdef SO_BUSY_POLL
+    if (rt->busy_poll_socket > 0) {
+        setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &rt->busy_poll_socket, sizeof(int));
+#ifdef SO_PREFER_BUSY_POLL
+        int one = 1;
+        setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(int));
+#endif
     }
+#endif
 
-    retval = connect(sockfd, addr, addrlen);
+    /*
+     * wait for the first bytes without a coroutine
+     */
+    if (li->opts.defer) {
+        ef_defer_fd(rt, li, socket);
+        return;
+    }
+
+    /*
+     * run it right now if no one queued before and the pool not exhausted
+     */
+    if (li->stat.queue_depth == 0 && !*exhausted) {
+        if (ef_routine_run(rt, li, socket) == 0) {
+            return;
+        }
+        *exhausted = 1;
+    }
+
+    /*
+     * put new connection to queue, accepted before the pause took effect
+     * if the queue is full
+     */
+    if (li->stat.queue_depth < li->opts.queue_limit) {
+        ef_queue_fd(li, socket, now);
+    } else {
+        ef_reject_fd(rt, socket);
+        ++li->stat.dropped;
+    }
+}
+
+inline void ef_timer_add(ef_runtime_t *rt, ef_routine_t *er, long expire)
+{
+    ef_list_entry_t *ent = ef_list_entry_before(&rt->timer_list);
+
+    /*
+     * mostly the same timeout, search from the tail
+     */
+    while (ent != &rt->timer_list && CAST_PARENT_PTR(ent, ef_routine_t, timer_entry)->timer_expire > expire) {
+        ent = ef_list_entry_before(ent);
+    }
+
+    er->timer_expire = expire;
+    ef_list_insert_after(ent, &er->timer_entry);
+}
+
+inline void ef_timer_fire(ef_runtime_t *rt, long now)
+{
+    while (!ef_list_empty(&rt->timer_list)) {
+        ef_routine_t *er = CAST_PARENT_PTR(ef_list_entry_after(&rt->timer_list), ef_routine_t, timer_entry);
+        if (er->timer_expire > now) {
+            break;
+        }
+
+        /*
+         * self linked, removing again is harmless
+         */
+        ef_list_remove_after(&rt->timer_list);
+        ef_list_init(&er->timer_entry);
+        ef_routine_wake(er);
+    }
+}
+
+int ef_post_init(ef_runtime_t *rt)
+{
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    rt->post_fd[0] = fd;
+    rt->post_fd[1] = fd;
+#else
+    if (pipe(rt->post_fd) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(rt->post_fd[i], F_SETFL, fcntl(rt->post_fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(rt->post_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    rt->post_signaled = 0;
+    rt->post_stopped = 0;
+    rt->post_users = 0;
+    rt->post_data.type = FD_TYPE_POST;
+    rt->post_data.fd = rt->post_fd[0];
+    rt->post_data.routine_ptr = NULL;
+    rt->post_data.runtime_ptr = rt;
+    rt->post_data.ef_proc = NULL;
+    ef_mpsc_init(&rt->post_queue);
+    return 0;
+}
+
+inline void ef_post_drain(ef_runtime_t *rt, int fired)
+{
+    uint64_t buf[16];
+    ef_mpsc_node_t *node;
+
+    if (fired) {
+
+        /*
+         * clear the flag before popping, posts after here will signal again
+         */
+        __atomic_exchange_n(&rt->post_signaled, 0, __ATOMIC_SEQ_CST);
+        while (read(rt->post_fd[0], buf, sizeof(buf)) > 0) {
+        }
+        ef_poll_call(rt->p, unset, rt->post_fd[0], EF_POLLIN);
+        ef_poll_call(rt->p, associate, rt->post_fd[0], EF_POLLIN, &rt->post_data, 1);
+    }
+
+    /*
+     * run all the tasks posted so far in one batch
+     */
+    long now = ef_time_microsecs();
+    while ((node = ef_mpsc_pop(&rt->post_queue)) != NULL) {
+        ef_post_task_t *task = CAST_PARENT_PTR(node, ef_post_task_t, node);
+        long latency = now - task->post_usecs;
+        if (latency > rt->wake_usecs_max) {
+            rt->wake_usecs_max = latency;
+        }
+        rt->wake_usecs += latency;
+        ++rt->wakes;
+        task->proc(task->arg);
+        free(task);
+    }
+}
+
+/*
+ * the loop waits for the posts in progress before closing post_fd
+ */
+inline void ef_post_stop(ef_runtime_t *rt)
+{
+    __atomic_store_n(&rt->post_stopped, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&rt->post_users, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+}
+
+int ef_runtime_post(ef_runtime_t *rt, ef_post_proc_t proc, void *arg)
+{
+    uint64_t one = 1;
+    int ret = 0;
+
+    /*
+     * either the loop sees the user, or the user sees the stop
+     */
+    __atomic_add_fetch(&rt->post_users, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rt->post_stopped, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&rt->post_users, 1, __ATOMIC_SEQ_CST);
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    ef_post_task_t *task = (ef_post_task_t*)malloc(sizeof(ef_post_task_t));
+    if (!task) {
+        __atomic_sub_fetch(&rt->post_users, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+
+    task->proc = proc;
+    task->arg = arg;
+    task->post_usecs = ef_time_microsecs();
+    ef_mpsc_push(&rt->post_queue, &task->node);
+
+    /*
+     * only the first post after the loop drained need to wake it up
+     */
+    if (__atomic_exchange_n(&rt->post_signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+        if (write(rt->post_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            ret = -1;
+        }
+    }
+    __atomic_sub_fetch(&rt->post_users, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+#ifndef __linux__
+void ef_signal_handler(int num)
+{
+    int error = errno;
+    unsigned char signo = (unsigned char)num;
+    if (write(ef_signal_pipe, &signo, 1) < 0) {
+    }
+    errno = error;
+}
+#endif
+
+int ef_stop_on_signals(ef_runtime_t *rt, const int *signals, int count)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    for (int i = 0; i < count; ++i) {
+        sigaddset(&mask, signals[i]);
+    }
+
+#ifdef __linux__
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        return -1;
+    }
+
+    /*
+     * update the mask if called again
+     */
+    int fd = signalfd(rt->signal_fd[0], &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    rt->signal_fd[0] = fd;
+    rt->signal_fd[1] = fd;
+#else
+    struct sigaction sa = {0};
+
+    if (rt->signal_fd[0] < 0) {
+        if (pipe(rt->signal_fd) < 0) {
+            return -1;
+        }
+        for (int i = 0; i < 2; ++i) {
+            fcntl(rt->signal_fd[i], F_SETFL, fcntl(rt->signal_fd[i], F_GETFL) | O_NONBLOCK);
+            fcntl(rt->signal_fd[i], F_SETFD, FD_CLOEXEC);
+        }
+        ef_signal_pipe = rt->signal_fd[1];
+    }
+
+    sa.sa_handler = ef_signal_handler;
+    sa.sa_mask = mask;
+    sa.sa_flags = SA_RESTART;
+    for (int i = 0; i < count; ++i) {
+        if (sigaction(signals[i], &sa, NULL) < 0) {
+            return -1;
+        }
+    }
+#endif
+
+    rt->signal_data.type = FD_TYPE_SIGNAL;
+    rt->signal_data.fd = rt->signal_fd[0];
+    rt->signal_data.routine_ptr = NULL;
+    rt->signal_data.runtime_ptr = rt;
+    rt->signal_data.ef_proc = NULL;
+    return 0;
+}
+
+inline void ef_signal_drain(ef_runtime_t *rt, long now)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si[4];
+#else
+    unsigned char si[16];
+#endif
+    ssize_t len;
+
+    while ((len = read(rt->signal_fd[0], si, sizeof(si))) > 0) {
+#ifdef __linux__
+        rt->stop_signal = si[len / sizeof(si[0]) - 1].ssi_signo;
+#else
+        rt->stop_signal = si[len - 1];
+#endif
+
+        /*
+         * signaled again while draining, do not wait any longer
+         */
+        if (rt->stopping && !rt->cancelled) {
+            rt->drain_expire = now;
+        }
+        rt->stopping = 1;
+    }
+
+    ef_poll_call(rt->p, unset, rt->signal_fd[0], EF_POLLIN);
+    ef_poll_call(rt->p, associate, rt->signal_fd[0], EF_POLLIN, &rt->signal_data, 1);
+}
+
+void ef_cancel_routines(ef_runtime_t *rt)
+{
+    ef_list_entry_t *ent = ef_list_entry_after(&rt->co_pool.full_list);
+
+    /*
+     * routines created from now on start cancelled
+     */
+    rt->cancelled = 1;
+
+    while (ent != &rt->co_pool.full_list) {
+        ef_routine_t *er = (ef_routine_t*)CAST_PARENT_PTR(ent, ef_coroutine_t, full_entry);
+        ent = ef_list_entry_after(ent);
+        if (!ef_fiber_is_exited(&er->co.fiber)) {
+            ef_routine_cancel(er);
+        }
+    }
+
+    /*
+     * nobody will serve the queued connections
+     */
+    ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        ent = ef_list_entry_after(ent);
+        while (li->stat.queue_depth > 0) {
+            ef_reject_fd(rt, ef_dequeue_fd(li));
+            ++li->stat.dropped;
+        }
+    }
+}
+
+int ef_init(ef_runtime_t *rt, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink)
+{
+    ef_poll_t *p = ef_create_poll(1024);
+    if (!p) {
+        return -1;
+    }
+
+    /*
+     * the global pointer
+     */
+    ef_runtime = rt;
+
+    rt->p = p;
+    rt->stopping = 0;
+    rt->shrink_millisecs = shrink_millisecs;
+    rt->count_per_shrink = count_per_shrink;
+    rt->ready_budget = EF_DEFAULT_READY_BUDGET;
+    rt->accept_budget = EF_DEFAULT_ACCEPT_BUDGET;
+    rt->signal_fd[0] = -1;
+    rt->signal_fd[1] = -1;
+    rt->stop_signal = 0;
+    rt->drain_millisecs = 0;
+    rt->drain_expire = 0;
+    rt->cancelled = 0;
+    rt->io_direct = 0;
+    rt->io_polled = 0;
+    rt->busy_poll_usecs = 0;
+    rt->busy_poll_socket = 0;
+    rt->busy_window = 0;
+    rt->busy_gap = 0;
+    rt->spins = 0;
+    rt->spin_hits = 0;
+    rt->spin_usecs = 0;
+    rt->wakes = 0;
+    rt->wake_usecs = 0;
+    rt->wake_usecs_max = 0;
+    rt->output_writes = 0;
+    rt->output_flushes = 0;
+    rt->splice_pooled = 0;
+
+    if (ef_coroutine_pool_init(&rt->co_pool, stack_size, limit_min, limit_max) < 0) {
+        return -1;
+    }
+    ef_list_init(&rt->listen_list);
+    ef_list_init(&rt->free_defer_list);
+    ef_list_init(&rt->active_list);
+    ef_sched_init(&rt->default_sched, EF_DEFAULT_WEIGHT);
+    rt->now = ef_time_millisecs();
+    ef_list_init(&rt->timer_list);
+
+    if (ef_post_init(rt) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int ef_add_listen(ef_runtime_t *rt, int socket, ef_routine_proc_t proc)
+{
+    return ef_add_listen_ex(rt, socket, proc, NULL);
+}
+
+int ef_add_listen_ex(ef_runtime_t *rt, int socket, ef_routine_proc_t proc, const ef_listen_opts_t *opts)
+{
+    /*
+     * set the listen socket in non-block mode
+     */
+    int retval = fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    if (retval < 0) {
+        return retval;
+    }
+
+    ef_listen_info_t *li = (ef_listen_info_t*)calloc(1, sizeof(ef_listen_info_t));
+    if (li == NULL) {
+        return -1;
+    }
+
+    li->poll_data.type = FD_TYPE_LISTEN;
+    li->poll_data.fd = socket;
+    li->poll_data.routine_ptr = NULL;
+    li->poll_data.runtime_ptr = rt;
+    li->ef_proc = proc;
+
+    if (opts) {
+        li->opts = *opts;
+    }
+    if (li->opts.queue_limit <= 0) {
+        li->opts.queue_limit = EF_DEFAULT_QUEUE_LIMIT;
+    }
+    if (li->opts.target_millisecs <= 0) {
+        li->opts.target_millisecs = EF_DEFAULT_TARGET_MILLISECS;
+    }
+    if (li->opts.interval_millisecs <= 0) {
+        li->opts.interval_millisecs = EF_DEFAULT_INTERVAL_MILLISECS;
+    }
+    if (li->opts.weight <= 0) {
+        li->opts.weight = EF_DEFAULT_WEIGHT;
+    }
+    ef_sched_init(&li->sched, li->opts.weight);
+
+    li->fd_ring = (ef_queue_fd_t*)malloc(sizeof(ef_queue_fd_t) * li->opts.queue_limit);
+    if (li->fd_ring == NULL) {
+        free(li);
+        return -1;
+    }
+
+    ef_list_init(&li->defer_list);
+    ef_list_insert_after(&rt->listen_list, &li->list_entry);
+
+    return 0;
+}
+
+int ef_get_listen_stat(ef_runtime_t *rt, int socket, ef_listen_stat_t *stat)
+{
+    ef_list_entry_t *ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        if (li->poll_data.fd == socket) {
+            *stat = li->stat;
+            stat->resumed = li->sched.resumed;
+            stat->ready_wait_total = li->sched.ready_wait_total;
+            stat->ready_wait_max = li->sched.ready_wait_max;
+            return 0;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+    return -1;
+}
+
+inline void ef_busy_adapt(ef_runtime_t *rt, long gap)
+{
+    long floor = rt->busy_poll_usecs / EF_BUSY_POLL_FLOOR;
+
+    /*
+     * spinning pays only if the next arrival likely comes within the
+     * window, when the average gap is too long just keep probing
+     */
+    rt->busy_gap += (gap - rt->busy_gap) / 8;
+    rt->busy_window = rt->busy_gap * 2;
+    if (rt->busy_window > rt->busy_poll_usecs) {
+        rt->busy_window = floor;
+    } else if (rt->busy_window < floor) {
+        rt->busy_window = floor;
+    }
+}
+
+inline int ef_busy_wait(ef_runtime_t *rt, ef_event_t *evts, int count, int timeout)
+{
+    long start = ef_time_microsecs();
+    long limit = (long)timeout * 1000;
+    long now = start;
+    int cnt = 0;
+
+    if (rt->busy_window == 0) {
+        rt->busy_window = rt->busy_poll_usecs;
+    }
+    if (limit > rt->busy_window) {
+        limit = rt->busy_window;
+    }
+
+    while (now - start < limit) {
+        cnt = ef_poll_call(rt->p, wait, evts, count, 0);
+        ++rt->spins;
+        now = ef_time_microsecs();
+        if (cnt != 0) {
+            break;
+        }
+    }
+    rt->spin_usecs += now - start;
+
+    if (cnt > 0) {
+        ++rt->spin_hits;
+        ef_busy_adapt(rt, now - start);
+        return cnt;
+    } else if (cnt < 0) {
+        return cnt;
+    }
+
+    /*
+     * block for the rest, a timeout counts as a gap spinning never catches
+     */
+    timeout -= (int)((now - start) / 1000);
+    cnt = ef_poll_call(rt->p, wait, evts, count, timeout > 0 ? timeout : 0);
+    if (cnt > 0) {
+        ef_busy_adapt(rt, ef_time_microsecs() - start);
+    } else if (cnt == 0) {
+        ef_busy_adapt(rt, (long)rt->busy_poll_usecs * 2);
+    }
+    return cnt;
+}
+
+int ef_run_loop(ef_runtime_t *rt)
+{
+    ef_event_t evts[1024];
+
+    /*
+     * add all listen socket fds to poll object
+     */
+    ef_list_entry_t *ent = ef_list_entry_after(&rt->listen_list);
+    while (ent != &rt->listen_list) {
+        ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+        int ret = ef_listen_poll(rt, li);
+        if (ret < 0) {
+            return ret;
+        }
+        ent = ef_list_entry_after(ent);
+    }
+
+    /*
+     * the fd signaled by ef_runtime_post
+     */
+    int ret = ef_poll_call(rt->p, associate, rt->post_fd[0], EF_POLLIN, &rt->post_data, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * the fd delivers stop signals
+     */
+    if (rt->signal_fd[0] >= 0) {
+        ret = ef_poll_call(rt->p, associate, rt->signal_fd[0], EF_POLLIN, &rt->signal_data, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /*
+     * the main event loop
+     */
+    while (1) {
+
+        /*
+         * do not block when there are ready routines, or queued connections
+         * and coroutines for them, nor beyond the first timer
+         */
+        int timeout = 1000;
+        if (!ef_list_empty(&rt->active_list) || ef_queue_runnable(rt)) {
+            timeout = 0;
+        } else if (!ef_list_empty(&rt->timer_list)) {
+            long left = CAST_PARENT_PTR(ef_list_entry_after(&rt->timer_list), ef_routine_t, timer_entry)->timer_expire - ef_time_millisecs();
+            if (left < timeout) {
+                timeout = (left > 0) ? (int)left : 0;
+            }
+        }
+        if (rt->drain_expire && !rt->cancelled) {
+            long left = rt->drain_expire - ef_time_millisecs();
+            if (left < timeout) {
+                timeout = (left > 0) ? (int)left : 0;
+            }
+        }
+        int cnt = (rt->busy_poll_usecs > 0 && timeout > 0) ? ef_busy_wait(rt, &evts[0], 1024, timeout) :
+            ef_poll_call(rt->p, wait, &evts[0], 1024, timeout);
+        if (cnt < 0 && errno != EINTR) {
+            return cnt;
+        }
+
+        int posted = 0;
+        int exhausted = 0;
+        long now = rt->now = ef_time_millisecs();
+
+        /*
+         * check all events returned by poll wait function
+         */
+        for (int i = 0; i < cnt; ++i) {
+            ef_poll_data_t *ed = (ef_poll_data_t*)evts[i].ptr;
+            if (ed->type == FD_TYPE_LISTEN) {
+                ef_listen_info_t *li = CAST_PARENT_PTR(ed, ef_listen_info_t, poll_data);
+
+                /*
+                 * accepted by the backend, one connection every event
+                 */
+                if (evts[i].events & EF_POLLDONE) {
+                    if (evts[i].res >= 0) {
+                        ef_listen_accepted(rt, li, evts[i].res, now, &exhausted);
+                    }
+                    if (li->stat.queue_depth >= li->opts.queue_limit && !li->stat.paused) {
+                        ef_poll_call(rt->p, dissociate, ed->fd, 0, 0);
+                        li->stat.paused = 1;
+                        ++li->stat.pauses;
+                    }
+                    continue;
+                }
+
+                /*
+                 * at most accept_budget connections, then leave the rest
+                 * to next loop, so other listen sockets and io events get served
+                 */
+                int accept_budget = rt->accept_budget * li->opts.weight;
+                for (int accepted = 0; accepted < accept_budget; ++accepted) {
+
+                    /*
+                     * stop polling the listen socket when the queue is full,
+                     * let the kernel backlog hold the rest
+                     */
+                    if (li->stat.queue_depth >= li->opts.queue_limit) {
+                        ef_poll_call(rt->p, dissociate, ed->fd, 0, 0);
+                        li->stat.paused = 1;
+                        ++li->stat.pauses;
+                        break;
+                    }
+
+                    int socket = ef_accept_fd(ed->fd);
+                    if (socket < 0) {
+                        if (errno == ECONNABORTED || errno == EINTR) {
+                            continue;
+                        }
+                        ef_poll_call(rt->p, unset, ed->fd, EF_POLLIN);
+                        break;
+                    }
+                    ef_listen_accepted(rt, li, socket, now, &exhausted);
+                }
+
+                /*
+                 * solaris event port will auto dissociate fd after event fired
+                 */
+                if (!li->stat.paused) {
+                    ef_poll_call(rt->p, associate, ed->fd, EF_POLLIN, ed, 1);
+                }
+            } else if (ed->type == FD_TYPE_RWC) {
+
+                /*
+                 * cancelled in this batch and already in the ready list
+                 */
+                if (ed->routine_ptr->status == ROUTINE_STATUS_RUNNING) {
+                    ef_coroutine_resume(&rt->co_pool, &ed->routine_ptr->co, evts[i].events);
+                }
+            } else if (ed->type == FD_TYPE_IO) {
+
+                /*
+                 * resume it with the result of the op
+                 */
+                if (ed->routine_ptr->status == ROUTINE_STATUS_RUNNING) {
+                    ef_coroutine_resume(&rt->co_pool, &ed->routine_ptr->co, evts[i].res);
+                }
+            } else if (ed->type == FD_TYPE_MULTI) {
+
+                /*
+                 * gather events and resume it later, more fds of it may fire in this batch
+                 */
+                ed->revents |= evts[i].events;
+                ef_routine_wake(ed->routine_ptr);
+            } else if (ed->type == FD_TYPE_POST) {
+                posted = 1;
+            } else if (ed->type == FD_TYPE_SIGNAL) {
+                ef_signal_drain(rt, now);
+            } else if (ed->type == FD_TYPE_DEFER) {
+                ef_defer_fd_t *df = CAST_PARENT_PTR(ed, ef_defer_fd_t, poll_data);
+                ef_listen_info_t *li = df->listen_info;
+                int socket = ed->fd;
+
+                ef_poll_call(rt->p, dissociate, socket, 1, 0);
+                ef_list_remove(&df->list_entry);
+                ef_list_insert_after(&rt->free_defer_list, &df->list_entry);
+                --li->stat.defer_count;
+
+                /*
+                 * closed by peer before sending anything
+                 */
+                if (!(evts[i].events & EF_POLLIN)) {
+                    ef_poll_call(rt->p, dissociate, socket, 1, 1);
+                    close(socket);
+                    continue;
+                }
+
+                if (li->stat.queue_depth == 0 && !exhausted) {
+                    if (ef_routine_run(rt, li, socket) == 0) {
+                        continue;
+                    }
+                    exhausted = 1;
+                }
+
+                if (li->stat.queue_depth < li->opts.queue_limit) {
+                    ef_queue_fd(li, socket, now);
+                } else {
+                    ef_reject_fd(rt, socket);
+                    ++li->stat.dropped;
+                }
+            }
+        }
+
+        /*
+         * tasks posted by other threads
+         */
+        ef_post_drain(rt, posted);
+
+        /*
+         * wake up the routines timed out
+         */
+        ef_timer_fire(rt, now);
+
+        /*
+         * handle queued connections
+         */
+        ent = ef_list_entry_after(&rt->listen_list);
+        while (ent != &rt->listen_list) {
+
+            ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+            ent = ef_list_entry_after(ent);
+
+            /*
+             * reject the connections queued too long instead of serving them late
+             */
+            while (li->stat.queue_depth > 0 && ef_codel_drop(li, now)) {
+                ef_reject_fd(rt, ef_dequeue_fd(li));
+                ++li->stat.dropped;
+            }
+        }
+
+        if (!exhausted) {
+            ef_dispatch_queue(rt, now);
+        }
+
+        ent = ef_list_entry_after(&rt->listen_list);
+        while (ent != &rt->listen_list) {
+
+            ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+            ent = ef_list_entry_after(ent);
+
+            if (li->stat.queue_depth == 0) {
+                li->first_above_time = 0;
+                li->dropping = 0;
+            }
+
+            /*
+             * poll the listen socket again when half of the queue drained
+             */
+            if (li->stat.paused && li->poll_data.fd >= 0 && li->stat.queue_depth <= li->opts.queue_limit / 2) {
+                li->stat.paused = 0;
+                ef_listen_poll(rt, li);
+            }
+        }
+
+        ef_resume_ready(rt);
+
+        if (rt->stopping) {
+
+            /*
+             * the drain deadline starts when the stopping noticed
+             */
+            if (rt->drain_millisecs > 0 && rt->drain_expire == 0) {
+                rt->drain_expire = now + rt->drain_millisecs;
+            }
+            if (rt->drain_expire && !rt->cancelled && now >= rt->drain_expire) {
+                ef_cancel_routines(rt);
+            }
+
+            /*
+             * close all listening socket
+             */
+            if (!ef_list_empty(&rt->listen_list)) {
+
+                ent = ef_list_entry_after(&rt->listen_list);
+
+                while (ent != &rt->listen_list) {
+
+                    ef_listen_info_t *li = CAST_PARENT_PTR(ent, ef_listen_info_t, list_entry);
+                    ent = ef_list_entry_after(ent);
+
+                    /*
+                     * close listening socket
+                     */
+                    if (li->poll_data.fd >= 0) {
+                        ef_poll_call(rt->p, dissociate, li->poll_data.fd, 0, 1);
+                        close(li->poll_data.fd);
+                        li->poll_data.fd = -1;
+                    }
+
+                    /*
+                     * close the deferred connections, nothing read yet
+                     */
+                    while (!ef_list_empty(&li->defer_list)) {
+                        ef_defer_fd_t *df = CAST_PARENT_PTR(ef_list_remove_after(&li->defer_list), ef_defer_fd_t, list_entry);
+                        ef_poll_call(rt->p, dissociate, df->poll_data.fd, 0, 1);
+                        close(df->poll_data.fd);
+                        free(df);
+                    }
+                    li->stat.defer_count = 0;
+
+                    /*
+                     * free listen info if connection queue empty and its routines exited
+                     */
+                    if (li->stat.queue_depth == 0 && li->sched.count == 0) {
+                        ef_list_remove(&li->list_entry);
+                        free(li->fd_ring);
+                        free(li);
+                    }
+                }
+            }
+
+            /*
+             * destroy the unused deferred fd records
+             */
+            while (!ef_list_empty(&rt->free_defer_list)) {
+                free(CAST_PARENT_PTR(ef_list_remove_after(&rt->free_defer_list), ef_defer_fd_t, list_entry));
+            }
+
+            /*
+             * shrink coroutine pool, to free
+             */
+            if (rt->co_pool.free_count == rt->co_pool.full_count) {
+                ef_post_stop(rt);
+                ef_poll_call(rt->p, dissociate, rt->post_fd[0], 0, 1);
+                ef_post_drain(rt, 0);
+                close(rt->post_fd[0]);
+                if (rt->post_fd[1] != rt->post_fd[0]) {
+                    close(rt->post_fd[1]);
+                }
+                if (rt->signal_fd[0] >= 0) {
+                    ef_poll_call(rt->p, dissociate, rt->signal_fd[0], 0, 1);
+                    close(rt->signal_fd[0]);
+                    if (rt->signal_fd[1] != rt->signal_fd[0]) {
+                        close(rt->signal_fd[1]);
+                    }
+                }
+
+                /*
+                 * the pipes kept for splicing
+                 */
+                while (rt->splice_pooled > 0) {
+                    --rt->splice_pooled;
+                    close(rt->splice_pipes[rt->splice_pooled][0]);
+                    close(rt->splice_pipes[rt->splice_pooled][1]);
+                }
+                rt->p->free(rt->p);
+                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.full_count);
+                break;
+            } else {
+                ef_coroutine_pool_shrink(&rt->co_pool, 0, -rt->co_pool.free_count);
+            }
+        }
+
+        if (rt->co_pool.free_count > 0 && rt->co_pool.full_count > rt->co_pool.limit_min) {
+            ef_coroutine_pool_shrink(&rt->co_pool, rt->shrink_millisecs, rt->count_per_shrink);
+        }
+    }
+    return 0;
+}
+
+ef_routine_t *ef_routine_spawn(ef_spawn_proc_t proc, void *arg)
+{
+    ef_runtime_t *rt = ef_runtime;
+    ef_routine_t *current, *er = (ef_routine_t*)ef_coroutine_create(&rt->co_pool, sizeof(ef_routine_t), ef_spawn_proc, NULL);
+    if (!er) {
+        return NULL;
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = -1;
+    er->poll_data.routine_ptr = er;
+    er->poll_data.runtime_ptr = rt;
+    er->poll_data.ef_proc = NULL;
+    er->spawn_proc = proc;
+    er->spawn_arg = arg;
+    er->retval = 0;
+    er->detached = 0;
+    er->joiner = NULL;
+    er->cancelled = rt->cancelled;
+    er->output = NULL;
+    er->notsock_fd = -1;
+
+    /*
+     * in the class of the spawner
+     */
+    current = ef_routine_current();
+    er->sched = current ? current->sched : &rt->default_sched;
+    ++er->sched->count;
+
+    /*
+     * first run by the loop, not nested in the caller
+     */
+    ef_routine_ready(er);
+    return er;
+}
+
+int ef_routine_join(ef_routine_t *er, ef_routine_t *target, long *retval)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * only one joiner, and not detached
+     */
+    if (target->spawn_proc == NULL || target->detached || target->joiner) {
+        return -1;
+    }
+
+    target->joiner = er;
+    while (target->status != ROUTINE_STATUS_EXITED) {
+        if (ef_routine_park(er) < 0) {
+            target->joiner = NULL;
+            return -1;
+        }
+    }
+
+    if (retval) {
+        *retval = target->retval;
+    }
+
+    /*
+     * let the target exit and go back to the pool
+     */
+    ef_routine_ready(target);
+    return 0;
+}
+
+int ef_routine_detach(ef_routine_t *target)
+{
+    if (target->spawn_proc == NULL || target->detached || target->joiner) {
+        return -1;
+    }
+
+    target->detached = 1;
+
+    /*
+     * already returned, just let it exit
+     */
+    if (target->status == ROUTINE_STATUS_EXITED) {
+        ef_routine_ready(target);
+    }
+    return 0;
+}
+
+int ef_routine_yield(ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * put to the tail of ready list, the loop will resume it later
+     */
+    ef_routine_flush_pending(er);
+    ef_routine_ready(er);
+    ef_fiber_yield(er->co.fiber.sched, 0);
+
+    /*
+     * let the busy routines know they should give up
+     */
+    if (er->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+long ef_routine_park(ef_routine_t *er)
+{
+    return ef_routine_park_on(er, NULL);
+}
+
+long ef_routine_park_on(ef_routine_t *er, ef_list_entry_t *wait_list)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * never park again once cancelled
+     */
+    if (er->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    ef_routine_flush_pending(er);
+
+    /*
+     * chain to the tail of wait_list, ef_routine_wake will remove it
+     */
+    if (wait_list) {
+        ef_list_insert_before(wait_list, &er->ready_entry);
+    } else {
+        ef_list_init(&er->ready_entry);
+    }
+
+    /*
+     * nobody resume it until ef_routine_wake called
+     */
+    er->status = ROUTINE_STATUS_PARKED;
+    return ef_fiber_yield(er->co.fiber.sched, 0);
+}
+
+int ef_routine_wake(ef_routine_t *er)
+{
+    /*
+     * only parked routine can be woken up
+     */
+    if (er->status != ROUTINE_STATUS_PARKED) {
+        return -1;
+    }
+
+    /*
+     * remove from the wait list if any
+     */
+    ef_list_remove(&er->ready_entry);
+
+    ef_routine_ready(er);
+    return 0;
+}
+
+int ef_routine_cancel(ef_routine_t *er)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+
+    if (ef_fiber_is_exited(&er->co.fiber)) {
+        return -1;
+    }
+
+    er->cancelled = 1;
+
+    if (er->status == ROUTINE_STATUS_PARKED) {
+        ef_routine_wake(er);
+    } else if (er->status == ROUTINE_STATUS_EXITED) {
+
+        /*
+         * release it if not being joined
+         */
+        ef_routine_detach(er);
+    } else if (er->status == ROUTINE_STATUS_RUNNING && er != ef_routine_current()) {
+
+        /*
+         * waiting io events, stop polling the fd and resume it with EF_POLLERR,
+         * a submitted op is resumed by its completion with -ECANCELED
+         */
+        ef_poll_call(rt->p, dissociate, er->poll_data.fd, 0, 0);
+        if (er->poll_data.type != FD_TYPE_IO) {
+            ef_routine_ready(er);
+        }
+    }
+    return 0;
+}
+
+inline long ef_routine_wait_io(ef_routine_t *er)
+{
+    if (er->cancelled) {
+        return EF_POLLERR;
+    }
+    return ef_fiber_yield(er->co.fiber.sched, 0);
+}
+
+/*
+ * let a completion based backend do the op, the result or -errno
+ * comes back as the resume value
+ */
+inline long ef_routine_submit(ef_routine_t *er, int op, int fd, void *buf, size_t len, int flags)
+{
+    ef_runtime_t *rt = er->poll_data.runtime_ptr;
+    long res;
+
+    if (er->cancelled) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    er->poll_data.type = FD_TYPE_IO;
+    er->poll_data.fd = fd;
+    if (rt->p->submit(rt->p, op, fd, buf, len, flags, &er->poll_data) < 0) {
+        er->poll_data.type = FD_TYPE_RWC;
+        return -1;
+    }
+
+    res = ef_fiber_yield(er->co.fiber.sched, 0);
+    er->poll_data.type = FD_TYPE_RWC;
+    if (res < 0) {
+        errno = (int)-res;
+        return -1;
+    }
+    return res;
+}
+
+int ef_routine_poll(ef_routine_t *er, const int *fds, int *events, int n, int millisecs)
+{
+    ef_poll_data_t pds[n > 0 ? n : 1];
+    ef_runtime_t *rt;
+    long expire = 0;
+    int idx, ret, ready = 0, error = 0, count = 0;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    rt = er->poll_data.runtime_ptr;
+    ef_routine_flush_pending(er);
+
+    /*
+     * every fd has its own poll data, all point to the routine
+     */
+    for (idx = 0; idx < n; ++idx) {
+        pds[idx].type = FD_TYPE_MULTI;
+        pds[idx].fd = fds[idx];
+        pds[idx].routine_ptr = er;
+        pds[idx].runtime_ptr = rt;
+        pds[idx].ef_proc = NULL;
+        pds[idx].revents = 0;
+
+        ret = ef_poll_call(rt->p, associate, fds[idx], events[idx], &pds[idx], 0);
+        if (ret < 0) {
+            error = errno;
+            break;
+        } else if (ret > 0) {
+            pds[idx].revents = events[idx];
+            ++ready;
+        }
+    }
+    count = idx;
+
+    if (!error && !ready && millisecs != 0) {
+        if (millisecs > 0) {
+            expire = ef_time_millisecs() + millisecs;
+            ef_timer_add(rt, er, expire);
+        }
+
+        /*
+         * woken up by events, the timer, or someone else
+         */
+        while (1) {
+            if (ef_routine_park(er) < 0) {
+                error = ECANCELED;
+                break;
+            }
+            for (idx = 0; idx < count; ++idx) {
+                if (pds[idx].revents) {
+                    ++ready;
+                }
+            }
+            if (ready || (millisecs > 0 && ef_time_millisecs() >= expire)) {
+                break;
+            }
+        }
+
+        if (millisecs > 0) {
+            ef_list_remove(&er->timer_entry);
+        }
+    }
+
+    /*
+     * dissociate all of them, return the fired events
+     */
+    for (idx = 0; idx < count; ++idx) {
+        ef_poll_call(rt->p, dissociate, fds[idx], pds[idx].revents != 0, 0);
+        events[idx] = pds[idx].revents;
+    }
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return ready;
+}
+
+int ef_routine_close(ef_routine_t *er, int fd)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * write out what buffered before the fd goes
+     */
+    if (er->output && er->output->fd == fd) {
+        ef_output_release(er);
+    }
+
+    if (er->notsock_fd == fd) {
+        er->notsock_fd = -1;
+    }
+
+    /*
+     * dissociate fd before close
+     */
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, fd, 0, 1);
+
+    return close(fd);
+}
+
+int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int retval, flags, error = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+    ef_routine_flush_pending(er);
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = sockfd;
+
+    /*
+     * set non-block mode if needed
+     */
+    flags = fcntl(sockfd, F_GETFL);
+    if (!(flags & O_NONBLOCK)) {
+        retval = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+        if (retval < 0) {
+            error = errno;
+            goto exit_conn;
+        }
+    }
+
+    /*
+     * the backend connects and resumes us with the result
+     */
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return (int)ef_routine_submit(er, EF_OP_CONNECT, sockfd, (void *)addr, addrlen, 0);
+    }
+
+    retval = connect(sockfd, addr, addrlen);
     if (retval < 0) {
         if (errno != EINPROGRESS) {
             error = errno;
             goto exit_conn;
         }
-        retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, sockfd, EF_POLLOUT, &er->poll_data, 0);
+        retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, sockfd, EF_POLLOUT, &er->poll_data, 0);
         if (retval < 0) {
             error = errno;
             goto exit_conn;
@@ -368,9 +1755,9 @@ int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr
     /*
      * yield and wait event
      */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
+    events = ef_routine_wait_io(er);
     if (events & (EF_POLLERR | EF_POLLHUP)) {
-        error = EBADF;
+        error = er->cancelled ? ECANCELED : EBADF;
         retval = -1;
     } else if (events & EF_POLLOUT) {
         socklen_t len = sizeof(error);
@@ -380,7 +1767,7 @@ int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr
     /*
      * dissociate fd after event fired
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, sockfd, 1, 0);
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, sockfd, 1, 0);
 
 exit_conn:
 
@@ -389,23 +1776,386 @@ exit_conn:
     return retval;
 }
 
+/*
+ * fd is not a socket, its flags tell whether read/write may go first
+ */
+void ef_routine_notsock(ef_routine_t *er, int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    er->notsock_fd = fd;
+    er->notsock_nonblock = flags >= 0 && (flags & O_NONBLOCK);
+}
+
 ssize_t ef_routine_read(ef_routine_t *er, int fd, void *buf, size_t count)
 {
-    int error = 0;
+    int error = 0, notsock;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, poll only when it would block, MSG_DONTWAIT keeps
+     * the loop safe from blocking sockets
+     */
+    if (fd != er->notsock_fd) {
+        retval = recv(fd, buf, count, MSG_DONTWAIT);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTSOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+        if (errno == ENOTSOCK) {
+            ef_routine_notsock(er, fd);
+        }
+    }
+
+    /*
+     * other fds are tried first only when they do not block
+     */
+    notsock = fd == er->notsock_fd;
+    if (notsock && er->notsock_nonblock) {
+        retval = read(fd, buf, count);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    /*
+     * the backend reads it and resumes us when done
+     */
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return ef_routine_submit(er, notsock ? EF_OP_READ : EF_OP_RECV, fd, buf, count, 0);
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = fd;
+
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, fd, EF_POLLIN, &er->poll_data, 0);
+    if (retval < 0) {
+        return retval;
+    } else if (retval > 0) {
+        goto ready;
+    }
+
+yield:
+
+    /*
+     * yield and wait event
+     */
+    events = ef_routine_wait_io(er);
+    if (events & EF_POLLERR) {
+        error = er->cancelled ? ECANCELED : EBADF;
+        retval = -1;
+    } else if (events & (EF_POLLIN | EF_POLLHUP)) {
+ready:
+        retval = read(fd, buf, count);
+        if (retval < 0 && errno == EAGAIN) {
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, fd, EF_POLLIN | EF_POLLHUP);
+            goto yield;
+        } else if (retval < 0) {
+            error = errno;
+        }
+    }
+
+    /*
+     * dissociate fd after event fired
+     */
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, fd, 1, 0);
+
+    errno = error;
+
+    return retval;
+}
+
+ssize_t ef_routine_write(ef_routine_t *er, int fd, const void *buf, size_t count)
+{
+    int error = 0, notsock;
+    long events;
+    ssize_t retval;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * taken by the output buffer
+     */
+    if (er->output && er->output->fd == fd && !er->output->flushing) {
+        struct iovec iov = {(void *)buf, count};
+        return ef_output_write(er, &iov, 1);
+    }
+
+    /*
+     * a fresh socket is almost always writable, try first
+     */
+    if (fd != er->notsock_fd) {
+        retval = send(fd, buf, count, MSG_DONTWAIT);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTSOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+        if (errno == ENOTSOCK) {
+            ef_routine_notsock(er, fd);
+        }
+    }
+
+    /*
+     * other fds are tried first only when they do not block
+     */
+    notsock = fd == er->notsock_fd;
+    if (notsock && er->notsock_nonblock) {
+        retval = write(fd, buf, count);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return ef_routine_submit(er, notsock ? EF_OP_WRITE : EF_OP_SEND, fd, (void *)buf, count, 0);
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = fd;
+
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, fd, EF_POLLOUT, &er->poll_data, 0);
+    if (retval < 0) {
+        return retval;
+    } else if (retval > 0) {
+        goto ready;
+    }
+
+yield:
+
+    /*
+     * yield and wait event
+     */
+    events = ef_routine_wait_io(er);
+    if (events & (EF_POLLERR | EF_POLLHUP)) {
+        error = er->cancelled ? ECANCELED : EBADF;
+        retval = -1;
+    } else if(events & EF_POLLOUT) {
+ready:
+        retval = write(fd, buf, count);
+        if (retval < 0 && errno == EAGAIN) {
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, fd, EF_POLLOUT);
+            goto yield;
+        } else if (retval < 0) {
+            error = errno;
+        }
+    }
+
+    /*
+     * dissociate fd after event fired
+     */
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, fd, 1, 0);
+
+    errno = error;
+
+    return retval;
+}
+
+ssize_t ef_routine_recv(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags)
+{
+    int retval, error = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, poll only when it would block
+     */
+    retval = recv(sockfd, buf, len, flags | MSG_DONTWAIT);
+    if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ++er->poll_data.runtime_ptr->io_direct;
+        return retval;
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return ef_routine_submit(er, EF_OP_RECV, sockfd, buf, len, flags);
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = sockfd;
+
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, sockfd, EF_POLLIN, &er->poll_data, 0);
+    if (retval < 0) {
+        return retval;
+    } else if (retval > 0) {
+        goto ready;
+    }
+
+yield:
+
+    /*
+     * yield and wait event
+     */
+    events = ef_routine_wait_io(er);
+    if (events & EF_POLLERR) {
+        error = er->cancelled ? ECANCELED : EBADF;
+        retval = -1;
+    } else if (events & (EF_POLLIN | EF_POLLHUP)) {
+ready:
+        retval = recv(sockfd, buf, len, flags);
+        if (retval < 0 && errno == EAGAIN) {
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, sockfd, EF_POLLIN | EF_POLLHUP);
+            goto yield;
+        } else if (retval < 0) {
+            error = errno;
+        }
+    }
+
+    /*
+     * dissociate fd after event fired
+     */
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, sockfd, 1, 0);
+
+    errno = error;
+
+    return retval;
+}
+
+ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags)
+{
+    int retval, error = 0;
+    long events;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * taken by the output buffer, or sent after it when flags given
+     */
+    if (er->output && er->output->fd == sockfd && !er->output->flushing) {
+        if (flags == 0) {
+            struct iovec iov = {(void *)buf, len};
+            return ef_output_write(er, &iov, 1);
+        }
+        if (ef_routine_flush(er) < 0) {
+            return -1;
+        }
+    }
+
+    /*
+     * try first, poll only when it would block
+     */
+    retval = send(sockfd, buf, len, flags | MSG_DONTWAIT);
+    if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ++er->poll_data.runtime_ptr->io_direct;
+        return retval;
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return ef_routine_submit(er, EF_OP_SEND, sockfd, (void *)buf, len, flags);
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = sockfd;
+
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, sockfd, EF_POLLOUT, &er->poll_data, 0);
+    if (retval < 0) {
+        return retval;
+    } else if (retval > 0) {
+        goto ready;
+    }
+
+yield:
+
+    /*
+     * yield and wait event
+     */
+    events = ef_routine_wait_io(er);
+    if (events & (EF_POLLERR | EF_POLLHUP)) {
+        error = er->cancelled ? ECANCELED : EBADF;
+        retval = -1;
+    } else if(events & EF_POLLOUT) {
+ready:
+        retval = send(sockfd, buf, len, flags);
+        if (retval < 0 && errno == EAGAIN) {
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, sockfd, EF_POLLOUT);
+            goto yield;
+        } else if (retval < 0) {
+            error = errno;
+        }
+    }
+
+    /*
+     * dissociate fd after event fired
+     */
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, sockfd, 1, 0);
+
+    errno = error;
+
+    return retval;
+}
+
+ssize_t ef_routine_readv(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt)
+{
+    int error = 0, notsock;
     long events;
     ssize_t retval;
+    struct msghdr msg = {0};
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * try first, recvmsg takes MSG_DONTWAIT where readv has no flags
+     */
+    if (fd != er->notsock_fd) {
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        retval = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTSOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+        if (errno == ENOTSOCK) {
+            ef_routine_notsock(er, fd);
+        }
+    }
+
+    /*
+     * other fds are tried first only when they do not block
+     */
+    notsock = fd == er->notsock_fd;
+    if (notsock && er->notsock_nonblock) {
+        retval = readv(fd, iov, iovcnt);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
 
-    if (er == NULL) {
-        er = ef_routine_current();
+    if (er->poll_data.runtime_ptr->p->submit) {
+        if (notsock) {
+            return ef_routine_submit(er, EF_OP_READV, fd, (void *)iov, iovcnt, 0);
+        }
+        return ef_routine_submit(er, EF_OP_RECVMSG, fd, &msg, 0, 0);
     }
 
     er->poll_data.type = FD_TYPE_RWC;
     er->poll_data.fd = fd;
 
-    /*
-     * always associate
-     */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, fd, EF_POLLIN, &er->poll_data, 0);
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, fd, EF_POLLIN, &er->poll_data, 0);
     if (retval < 0) {
         return retval;
     } else if (retval > 0) {
@@ -417,15 +2167,15 @@ yield:
     /*
      * yield and wait event
      */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
+    events = ef_routine_wait_io(er);
     if (events & EF_POLLERR) {
-        error = EBADF;
+        error = er->cancelled ? ECANCELED : EBADF;
         retval = -1;
     } else if (events & (EF_POLLIN | EF_POLLHUP)) {
 ready:
-        retval = read(fd, buf, count);
+        retval = readv(fd, iov, iovcnt);
         if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, fd, EF_POLLIN | EF_POLLHUP);
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, fd, EF_POLLIN | EF_POLLHUP);
             goto yield;
         } else if (retval < 0) {
             error = errno;
@@ -435,30 +2185,72 @@ ready:
     /*
      * dissociate fd after event fired
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 1, 0);
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, fd, 1, 0);
 
     errno = error;
 
     return retval;
 }
 
-ssize_t ef_routine_write(ef_routine_t *er, int fd, const void *buf, size_t count)
+ssize_t ef_routine_writev(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt)
 {
-    int error = 0;
+    int error = 0, notsock;
     long events;
     ssize_t retval;
+    struct msghdr msg = {0};
 
     if (er == NULL) {
         er = ef_routine_current();
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = fd;
+    /*
+     * taken by the output buffer
+     */
+    if (er->output && er->output->fd == fd && !er->output->flushing) {
+        return ef_output_write(er, iov, iovcnt);
+    }
+
+    /*
+     * headers and body go out in one syscall, try first
+     */
+    if (fd != er->notsock_fd) {
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        retval = sendmsg(fd, &msg, MSG_DONTWAIT);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTSOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+        if (errno == ENOTSOCK) {
+            ef_routine_notsock(er, fd);
+        }
+    }
 
     /*
-     * always associate
+     * other fds are tried first only when they do not block
      */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, fd, EF_POLLOUT, &er->poll_data, 0);
+    notsock = fd == er->notsock_fd;
+    if (notsock && er->notsock_nonblock) {
+        retval = writev(fd, iov, iovcnt);
+        if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ++er->poll_data.runtime_ptr->io_direct;
+            return retval;
+        }
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    if (er->poll_data.runtime_ptr->p->submit) {
+        if (notsock) {
+            return ef_routine_submit(er, EF_OP_WRITEV, fd, (void *)iov, iovcnt, 0);
+        }
+        return ef_routine_submit(er, EF_OP_SENDMSG, fd, &msg, 0, 0);
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = fd;
+
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, fd, EF_POLLOUT, &er->poll_data, 0);
     if (retval < 0) {
         return retval;
     } else if (retval > 0) {
@@ -470,15 +2262,15 @@ yield:
     /*
      * yield and wait event
      */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
+    events = ef_routine_wait_io(er);
     if (events & (EF_POLLERR | EF_POLLHUP)) {
-        error = EBADF;
+        error = er->cancelled ? ECANCELED : EBADF;
         retval = -1;
     } else if(events & EF_POLLOUT) {
 ready:
-        retval = write(fd, buf, count);
+        retval = writev(fd, iov, iovcnt);
         if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, fd, EF_POLLOUT);
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, fd, EF_POLLOUT);
             goto yield;
         } else if (retval < 0) {
             error = errno;
@@ -488,29 +2280,42 @@ ready:
     /*
      * dissociate fd after event fired
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, fd, 1, 0);
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, fd, 1, 0);
 
     errno = error;
 
     return retval;
 }
 
-ssize_t ef_routine_recv(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags)
+ssize_t ef_routine_recvmsg(ef_routine_t *er, int sockfd, struct msghdr *msg, int flags)
 {
-    int retval, error = 0;
+    int error = 0;
     long events;
+    ssize_t retval;
 
     if (er == NULL) {
         er = ef_routine_current();
     }
 
+    /*
+     * try first, poll only when it would block
+     */
+    retval = recvmsg(sockfd, msg, flags | MSG_DONTWAIT);
+    if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ++er->poll_data.runtime_ptr->io_direct;
+        return retval;
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return ef_routine_submit(er, EF_OP_RECVMSG, sockfd, msg, 0, flags);
+    }
+
     er->poll_data.type = FD_TYPE_RWC;
     er->poll_data.fd = sockfd;
 
-    /*
-     * always associate
-     */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, sockfd, EF_POLLIN, &er->poll_data, 0);
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, sockfd, EF_POLLIN, &er->poll_data, 0);
     if (retval < 0) {
         return retval;
     } else if (retval > 0) {
@@ -522,15 +2327,15 @@ yield:
     /*
      * yield and wait event
      */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
+    events = ef_routine_wait_io(er);
     if (events & EF_POLLERR) {
-        error = EBADF;
+        error = er->cancelled ? ECANCELED : EBADF;
         retval = -1;
     } else if (events & (EF_POLLIN | EF_POLLHUP)) {
 ready:
-        retval = recv(sockfd, buf, len, flags);
+        retval = recvmsg(sockfd, msg, flags);
         if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, sockfd, EF_POLLIN | EF_POLLHUP);
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, sockfd, EF_POLLIN | EF_POLLHUP);
             goto yield;
         } else if (retval < 0) {
             error = errno;
@@ -540,28 +2345,49 @@ ready:
     /*
      * dissociate fd after event fired
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, sockfd, 1, 0);
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, sockfd, 1, 0);
 
     errno = error;
 
     return retval;
 }
 
-ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags)
+ssize_t ef_routine_sendmsg(ef_routine_t *er, int sockfd, const struct msghdr *msg, int flags)
 {
-    int retval, error = 0;
+    int error = 0;
     long events;
+    ssize_t retval;
 
     if (er == NULL) {
         er = ef_routine_current();
     }
 
-    er->poll_data.type = FD_TYPE_RWC;
-    er->poll_data.fd = sockfd;
     /*
-     * always associate
+     * may carry control data, sent after the output buffer
+     */
+    if (er->output && er->output->fd == sockfd && !er->output->flushing && ef_routine_flush(er) < 0) {
+        return -1;
+    }
+
+    /*
+     * try first, poll only when it would block
      */
-    retval = er->poll_data.runtime_ptr->p->associate(er->poll_data.runtime_ptr->p, sockfd, EF_POLLOUT, &er->poll_data, 0);
+    retval = sendmsg(sockfd, msg, flags | MSG_DONTWAIT);
+    if (retval >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ++er->poll_data.runtime_ptr->io_direct;
+        return retval;
+    }
+    ++er->poll_data.runtime_ptr->io_polled;
+    ef_routine_flush_pending(er);
+
+    if (er->poll_data.runtime_ptr->p->submit) {
+        return ef_routine_submit(er, EF_OP_SENDMSG, sockfd, (void *)msg, 0, flags);
+    }
+
+    er->poll_data.type = FD_TYPE_RWC;
+    er->poll_data.fd = sockfd;
+
+    retval = ef_poll_call(er->poll_data.runtime_ptr->p, associate, sockfd, EF_POLLOUT, &er->poll_data, 0);
     if (retval < 0) {
         return retval;
     } else if (retval > 0) {
@@ -573,15 +2399,15 @@ yield:
     /*
      * yield and wait event
      */
-    events = ef_fiber_yield(er->co.fiber.sched, 0);
+    events = ef_routine_wait_io(er);
     if (events & (EF_POLLERR | EF_POLLHUP)) {
-        error = EBADF;
+        error = er->cancelled ? ECANCELED : EBADF;
         retval = -1;
     } else if(events & EF_POLLOUT) {
 ready:
-        retval = send(sockfd, buf, len, flags);
+        retval = sendmsg(sockfd, msg, flags);
         if (retval < 0 && errno == EAGAIN) {
-            er->poll_data.runtime_ptr->p->unset(er->poll_data.runtime_ptr->p, sockfd, EF_POLLOUT);
+            ef_poll_call(er->poll_data.runtime_ptr->p, unset, sockfd, EF_POLLOUT);
             goto yield;
         } else if (retval < 0) {
             error = errno;
@@ -591,9 +2417,384 @@ ready:
     /*
      * dissociate fd after event fired
      */
-    er->poll_data.runtime_ptr->p->dissociate(er->poll_data.runtime_ptr->p, sockfd, 1, 0);
+    ef_poll_call(er->poll_data.runtime_ptr->p, dissociate, sockfd, 1, 0);
 
     errno = error;
 
     return retval;
 }
+
+ssize_t ef_routine_write_all(ef_routine_t *er, int fd, const void *buf, size_t count)
+{
+    size_t done = 0;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (done < count) {
+        ssize_t w = ef_routine_write(er, fd, (const char *)buf + done, count - done);
+        if (w < 0) {
+            return -1;
+        }
+        done += w;
+    }
+    return (ssize_t)done;
+}
+
+ssize_t ef_routine_read_exact(ef_routine_t *er, int fd, void *buf, size_t count)
+{
+    size_t done = 0;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    /*
+     * short only when eof comes first
+     */
+    while (done < count) {
+        ssize_t r = ef_routine_read(er, fd, (char *)buf + done, count - done);
+        if (r < 0) {
+            return -1;
+        } else if (r == 0) {
+            break;
+        }
+        done += r;
+    }
+    return (ssize_t)done;
+}
+
+ssize_t ef_routine_writev_all(ef_routine_t *er, int fd, struct iovec *iov, int iovcnt)
+{
+    size_t done = 0;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (iovcnt > 0) {
+
+        /*
+         * skip the empty ones, writev of nothing returns 0 forever
+         */
+        if (iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        ssize_t w = ef_routine_writev(er, fd, iov, iovcnt);
+        if (w < 0) {
+            return -1;
+        }
+        done += w;
+
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (w > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return (ssize_t)done;
+}
+
+int ef_routine_buffer_output(ef_routine_t *er, int fd, size_t size)
+{
+    ef_output_t *out;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (size == 0) {
+        size = EF_DEFAULT_OUTPUT_BUFFER;
+    }
+
+    /*
+     * one buffer a routine, the one of another fd written out first
+     */
+    if (er->output) {
+        ef_output_release(er);
+    }
+
+    out = (ef_output_t *)malloc(sizeof(ef_output_t) + size);
+    if (!out) {
+        return -1;
+    }
+    out->fd = fd;
+    out->flushing = 0;
+    out->error = 0;
+    out->len = 0;
+    out->cap = size;
+    out->buf = (char *)(out + 1);
+    er->output = out;
+    return 0;
+}
+
+/*
+ * the buffered bytes and iov after them go out in one writev,
+ * a failure is kept and returned by the later writes
+ */
+ssize_t ef_output_flush(ef_routine_t *er, const struct iovec *iov, int iovcnt)
+{
+    ef_output_t *out = er->output;
+    struct iovec vec[iovcnt + 1];
+    ssize_t retval;
+    int idx, cnt = 0;
+
+    if (out->error) {
+        errno = out->error;
+        return -1;
+    }
+
+    if (out->len) {
+        vec[cnt].iov_base = out->buf;
+        vec[cnt].iov_len = out->len;
+        ++cnt;
+    }
+    for (idx = 0; idx < iovcnt; ++idx) {
+        vec[cnt++] = iov[idx];
+    }
+    if (cnt == 0) {
+        return 0;
+    }
+
+    out->flushing = 1;
+    retval = ef_routine_writev_all(er, out->fd, vec, cnt);
+    out->flushing = 0;
+    out->len = 0;
+    ++er->poll_data.runtime_ptr->output_flushes;
+    if (retval < 0) {
+        out->error = errno;
+    }
+    return retval;
+}
+
+ssize_t ef_output_write(ef_routine_t *er, const struct iovec *iov, int iovcnt)
+{
+    ef_output_t *out = er->output;
+    size_t total = 0;
+    int idx;
+
+    ++er->poll_data.runtime_ptr->output_writes;
+    if (out->error) {
+        errno = out->error;
+        return -1;
+    }
+
+    for (idx = 0; idx < iovcnt; ++idx) {
+        total += iov[idx].iov_len;
+    }
+
+    /*
+     * copied if it fits, or written out together with the buffer
+     */
+    if (out->len + total <= out->cap) {
+        for (idx = 0; idx < iovcnt; ++idx) {
+            memcpy(out->buf + out->len, iov[idx].iov_base, iov[idx].iov_len);
+            out->len += iov[idx].iov_len;
+        }
+        return (ssize_t)total;
+    }
+
+    if (ef_output_flush(er, iov, iovcnt) < 0) {
+        return -1;
+    }
+    return (ssize_t)total;
+}
+
+int ef_routine_flush(ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (!er->output) {
+        return 0;
+    }
+    return ef_output_flush(er, NULL, 0) < 0 ? -1 : 0;
+}
+
+void ef_output_release(ef_routine_t *er)
+{
+    if (!er->output) {
+        return;
+    }
+
+    ef_output_flush(er, NULL, 0);
+    free(er->output);
+    er->output = NULL;
+}
+
+/*
+ * through a buffer when the fds can not be spliced
+ */
+ssize_t ef_splice_copy(ef_routine_t *er, int in_fd, int out_fd, size_t len)
+{
+    char buf[8192];
+    ssize_t retval;
+
+    retval = ef_routine_read(er, in_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+    if (retval <= 0) {
+        return retval;
+    }
+    return ef_routine_write_all(er, out_fd, buf, retval) < 0 ? -1 : retval;
+}
+
+#ifdef __linux__
+/*
+ * an emptied pipe back to the loop, closed when enough kept
+ */
+void ef_splice_release(ef_runtime_t *rt, int *pfd)
+{
+    if (rt->splice_pooled < EF_SPLICE_PIPES) {
+        rt->splice_pipes[rt->splice_pooled][0] = pfd[0];
+        rt->splice_pipes[rt->splice_pooled][1] = pfd[1];
+        ++rt->splice_pooled;
+    } else {
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+}
+#endif
+
+ssize_t ef_routine_splice(ef_routine_t *er, int in_fd, int out_fd, size_t len)
+{
+#ifdef __linux__
+    ef_runtime_t *rt;
+    int pfd[2], events, error;
+    ssize_t retval, moved;
+    size_t left;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    rt = er->poll_data.runtime_ptr;
+
+    /*
+     * the bytes buffered for out_fd go first
+     */
+    if (er->output && er->output->fd == out_fd && !er->output->flushing && ef_routine_flush(er) < 0) {
+        return -1;
+    }
+
+    /*
+     * an empty pipe of the loop, owned until the bytes are out of it
+     */
+    if (rt->splice_pooled > 0) {
+        --rt->splice_pooled;
+        pfd[0] = rt->splice_pipes[rt->splice_pooled][0];
+        pfd[1] = rt->splice_pipes[rt->splice_pooled][1];
+    } else if (pipe2(pfd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    /*
+     * into the pipe, it is empty so only in_fd is waited for
+     */
+    while (1) {
+        moved = splice(in_fd, NULL, pfd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved >= 0) {
+            break;
+        }
+        if (errno == EINVAL) {
+
+            /*
+             * not a spliceable fd, nothing taken from it yet
+             */
+            ef_splice_release(rt, pfd);
+            return ef_splice_copy(er, in_fd, out_fd, len);
+        }
+        if (errno != EAGAIN) {
+            goto failed;
+        }
+
+        /*
+         * readiness kept by edge triggered backends is stale now
+         */
+        ef_poll_call(rt->p, unset, in_fd, EF_POLLIN | EF_POLLHUP);
+        events = EF_POLLIN;
+        if (ef_routine_poll(er, &in_fd, &events, 1, -1) < 0) {
+            goto failed;
+        }
+    }
+
+    /*
+     * out of the pipe, waiting for out_fd when it is full
+     */
+    left = moved;
+    while (left > 0) {
+        retval = splice(pfd[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (retval > 0) {
+            left -= retval;
+            continue;
+        }
+        if (retval < 0 && errno == EINVAL) {
+
+            /*
+             * out_fd can not be spliced to, the pipe is read out instead
+             */
+            char buf[8192];
+            retval = read(pfd[0], buf, left < sizeof(buf) ? left : sizeof(buf));
+            if (retval <= 0 || ef_routine_write_all(er, out_fd, buf, retval) < 0) {
+                goto failed;
+            }
+            left -= retval;
+            continue;
+        }
+        if (retval < 0 && errno != EAGAIN) {
+            goto failed;
+        }
+        ef_poll_call(rt->p, unset, out_fd, EF_POLLOUT);
+        events = EF_POLLOUT;
+        if (ef_routine_poll(er, &out_fd, &events, 1, -1) < 0) {
+            goto failed;
+        }
+    }
+
+    ef_splice_release(rt, pfd);
+    return moved;
+
+failed:
+
+    /*
+     * the pipe may still hold bytes, not reused
+     */
+    error = errno;
+    close(pfd[0]);
+    close(pfd[1]);
+    errno = error;
+    return -1;
+#else
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+    return ef_splice_copy(er, in_fd, out_fd, len);
+#endif
+}
+
+ssize_t ef_routine_forward_all(ef_routine_t *er, int in_fd, int out_fd)
+{
+    ssize_t retval, total = 0;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (1) {
+        retval = ef_routine_splice(er, in_fd, out_fd, EF_SPLICE_CHUNK);
+        if (retval < 0) {
+            return retval;
+        }
+        if (retval == 0) {
+            return total;
+        }
+        total += retval;
+    }
+}
@@ -23,21 +23,81 @@
 
 #include "coroutine.h"
 #include "util/list.h"
+#include "util/mpsc.h"
 #include "poll.h"
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define FD_TYPE_LISTEN 1 // listen
 #define FD_TYPE_RWC    2 // read (recv), write (send), connect
+#define FD_TYPE_POST   3 // wake up the loop when tasks posted by other threads
+#define FD_TYPE_DEFER  4 // accepted connection waiting for its first bytes
+#define FD_TYPE_MULTI  5 // one of the fds waited by ef_routine_poll
+#define FD_TYPE_SIGNAL 6 // stop signals delivered as an fd
+#define FD_TYPE_IO     7 // an op submitted to a completion based backend
+
+#define ROUTINE_STATUS_RUNNING 0 // running or waiting io events
+#define ROUTINE_STATUS_READY   1 // in the ready list, will be resumed by the loop
+#define ROUTINE_STATUS_PARKED  2 // waiting to be woken up by ef_routine_wake
+#define ROUTINE_STATUS_EXITED  3 // spawned routine returned, waiting to be joined
+
+/*
+ * max number of ready routines resumed in one loop
+ */
+#define EF_DEFAULT_READY_BUDGET 64
+
+/*
+ * max number of connections accepted from one listen socket in one loop
+ */
+#define EF_DEFAULT_ACCEPT_BUDGET 64
+
+/*
+ * default admission control of the accepted connection queue
+ */
+#define EF_DEFAULT_QUEUE_LIMIT        1024
+#define EF_DEFAULT_TARGET_MILLISECS   5
+#define EF_DEFAULT_INTERVAL_MILLISECS 100
+
+/*
+ * the share of a listener in accept dispatch and routine resumption
+ */
+#define EF_DEFAULT_WEIGHT 1
+
+/*
+ * the busy poll window never shrinks below 1/EF_BUSY_POLL_FLOOR of
+ * busy_poll_usecs, so it keeps probing when arrivals get sparse
+ */
+#define EF_BUSY_POLL_FLOOR 16
+
+/*
+ * bytes an output buffer holds before it is flushed
+ */
+#define EF_DEFAULT_OUTPUT_BUFFER 16384
+
+/*
+ * pipes a loop keeps for splicing, and the bytes a splice moves at most
+ * through one of them
+ */
+#define EF_SPLICE_PIPES 16
+#define EF_SPLICE_CHUNK 65536
 
 typedef struct _ef_routine ef_routine_t;
 typedef struct _ef_runtime ef_runtime_t;
 typedef struct _ef_queue_fd ef_queue_fd_t;
+typedef struct _ef_defer_fd ef_defer_fd_t;
 typedef struct _ef_poll_data ef_poll_data_t;
 typedef struct _ef_listen_info ef_listen_info_t;
+typedef struct _ef_listen_opts ef_listen_opts_t;
+typedef struct _ef_listen_stat ef_listen_stat_t;
+typedef struct _ef_post_task ef_post_task_t;
+typedef struct _ef_sched_class ef_sched_class_t;
+typedef struct _ef_output ef_output_t;
 
 typedef long (*ef_routine_proc_t)(int fd, ef_routine_t *er);
+typedef long (*ef_spawn_proc_t)(void *arg, ef_routine_t *er);
+typedef void (*ef_post_proc_t)(void *arg);
 
 struct _ef_poll_data {
     int type;
@@ -45,18 +105,149 @@ struct _ef_poll_data {
     ef_routine_t *routine_ptr;
     ef_runtime_t *runtime_ptr;
     ef_routine_proc_t ef_proc;
+
+    /*
+     * events gathered for FD_TYPE_MULTI
+     */
+    int revents;
 };
 
 struct _ef_queue_fd {
     int fd;
+    long enqueue_time;
+};
+
+/*
+ * the small record holds an accepted connection before it becomes readable
+ */
+struct _ef_defer_fd {
+    ef_poll_data_t poll_data;
+    ef_listen_info_t *listen_info;
     ef_list_entry_t list_entry;
 };
 
+struct _ef_listen_opts {
+
+    /*
+     * stop polling the listen socket when so many connections queued,
+     * completion based backends accept ahead of the pause, the ones
+     * beyond the limit are reset instead of left in the backlog
+     */
+    int queue_limit;
+
+    /*
+     * start dropping queued connections when the queue delay stayed
+     * above target for an interval, codel style
+     */
+    int target_millisecs;
+    int interval_millisecs;
+
+    /*
+     * do not take a coroutine until the accepted connection readable,
+     * idle connections only cost an ef_defer_fd_t
+     */
+    int defer;
+
+    /*
+     * served weight times as much as a listener of weight 1 when busy
+     */
+    int weight;
+};
+
+struct _ef_listen_stat {
+    int queue_depth;
+    int defer_count;
+    int paused;
+    unsigned long accepted;
+    unsigned long dropped;
+    unsigned long pauses;
+
+    /*
+     * connections dispatched from the queue and their wait in the queue,
+     * routines resumed from the ready list and their wait there,
+     * in millisecs at the loop time resolution
+     */
+    unsigned long dispatched;
+    unsigned long queue_wait_total;
+    long queue_wait_max;
+    unsigned long resumed;
+    unsigned long ready_wait_total;
+    long ready_wait_max;
+};
+
+/*
+ * the ready routines of a listener, or the ones without a listener,
+ * served in deficit round robin by weight
+ */
+struct _ef_sched_class {
+    int weight;
+    int deficit;
+    int active;
+
+    /*
+     * the number of routines in the class, the class outlives them
+     */
+    int count;
+    ef_list_entry_t ready_list;
+    ef_list_entry_t active_entry;
+    unsigned long resumed;
+    unsigned long ready_wait_total;
+    long ready_wait_max;
+};
+
 struct _ef_listen_info {
     ef_poll_data_t poll_data;
     ef_routine_proc_t ef_proc;
     ef_list_entry_t list_entry;
-    ef_list_entry_t fd_list;
+    ef_listen_opts_t opts;
+    ef_listen_stat_t stat;
+    ef_sched_class_t sched;
+
+    /*
+     * dispatch quantum left, the listener stays at the head of
+     * listen_list when the pool exhausted
+     */
+    int deficit;
+
+    /*
+     * accepted connections waiting for coroutines, stat.queue_depth
+     * of opts.queue_limit slots used from ring_head
+     */
+    ef_queue_fd_t *fd_ring;
+    int ring_head;
+
+    /*
+     * deferred connections not readable yet
+     */
+    ef_list_entry_t defer_list;
+
+    /*
+     * codel state
+     */
+    long first_above_time;
+    long drop_next;
+    int drop_count;
+    int dropping;
+};
+
+/*
+ * writes of a routine to fd buffered by ef_routine_buffer_output, flushing
+ * is set while they are written out, error is kept for the later writes
+ */
+struct _ef_output {
+    int fd;
+    int flushing;
+    int error;
+    size_t len;
+    size_t cap;
+    char *buf;
+};
+
+struct _ef_post_task {
+    ef_mpsc_node_t node;
+    ef_post_proc_t proc;
+    void *arg;
+    long post_usecs;
 };
 
 struct _ef_runtime {
@@ -64,14 +255,119 @@ struct _ef_runtime {
     int stopping;
     int shrink_millisecs;
     int count_per_shrink;
+    int ready_budget;
+    int accept_budget;
     ef_coroutine_pool_t co_pool;
+
+    /*
+     * the classes having ready routines, default_sched for the routines
+     * not from any listener, now is the loop time in millisecs
+     */
+    ef_list_entry_t active_list;
+    ef_sched_class_t default_sched;
+    long now;
+
+    /*
+     * routines waiting with timeout, sorted by expire time
+     */
+    ef_list_entry_t timer_list;
     ef_list_entry_t listen_list;
-    ef_list_entry_t free_fd_list;
+    ef_list_entry_t free_defer_list;
+
+    /*
+     * tasks posted by other threads, post_fd[0] is polled by the loop,
+     * post_signaled makes a burst of posts write post_fd[1] only once,
+     * post_stopped set when the loop exits, it waits for the post_users
+     * in ef_runtime_post before closing post_fd
+     */
+    int post_fd[2];
+    int post_signaled;
+    int post_stopped;
+    int post_users;
+    ef_poll_data_t post_data;
+    ef_mpsc_queue_t post_queue;
+
+    /*
+     * signals set by ef_stop_on_signals, read from signal_fd[0], signal_fd[1]
+     * is the write end of the self pipe where no signalfd
+     */
+    int signal_fd[2];
+    int stop_signal;
+    ef_poll_data_t signal_data;
+
+    /*
+     * routines still blocked drain_millisecs after stopping get cancelled,
+     * no deadline if 0, a second stop signal cancels them at once
+     */
+    int drain_millisecs;
+    long drain_expire;
+    int cancelled;
+
+    /*
+     * io calls done by the first try without touching the poll backend,
+     * and the ones polled
+     */
+    unsigned long io_direct;
+    unsigned long io_polled;
+
+    /*
+     * spin with zero timeout waits up to busy_poll_usecs before blocking,
+     * 0 disables it, the window follows twice the average gap between
+     * arrivals, busy_poll_socket sets SO_BUSY_POLL of accepted sockets
+     */
+    int busy_poll_usecs;
+    int busy_poll_socket;
+    long busy_window;
+    long busy_gap;
+
+    /*
+     * spin_usecs is the cpu burnt spinning, spin_hits the spins ended by
+     * events, the wake latency is measured from ef_runtime_post to the task
+     */
+    unsigned long spins;
+    unsigned long spin_hits;
+    unsigned long spin_usecs;
+    unsigned long wakes;
+    unsigned long wake_usecs;
+    long wake_usecs_max;
+
+    /*
+     * writes taken by output buffers and the flushes writing them out,
+     * the syscalls saved are output_writes - output_flushes
+     */
+    unsigned long output_writes;
+    unsigned long output_flushes;
+
+    /*
+     * the pipes splice went through, empty, reused by the next splice
+     */
+    int splice_pipes[EF_SPLICE_PIPES][2];
+    int splice_pooled;
 };
 
 struct _ef_routine {
     ef_coroutine_t co;
     ef_poll_data_t poll_data;
+    int status;
+    ef_list_entry_t ready_entry;
+    ef_sched_class_t *sched;
+    long ready_time;
+    ef_spawn_proc_t spawn_proc;
+    void *spawn_arg;
+    long retval;
+    int detached;
+    ef_routine_t *joiner;
+    int cancelled;
+    long timer_expire;
+    ef_list_entry_t timer_entry;
+    ef_output_t *output;
+
+    /*
+     * the last fd found not a socket, its io skips the socket call, and
+     * goes to read/write directly when notsock_nonblock, -1 if none
+     */
+    int notsock_fd;
+    int notsock_nonblock;
 };
 
 extern ef_runtime_t *ef_runtime;
@@ -80,14 +376,100 @@ extern ef_runtime_t *ef_runtime;
 
 int ef_init(ef_runtime_t *rt, size_t stack_size, int limit_min, int limit_max, int shrink_millisecs, int count_per_shrink);
 int ef_add_listen(ef_runtime_t *rt, int socket, ef_routine_proc_t ef_proc);
+int ef_add_listen_ex(ef_runtime_t *rt, int socket, ef_routine_proc_t ef_proc, const ef_listen_opts_t *opts);
+int ef_get_listen_stat(ef_runtime_t *rt, int socket, ef_listen_stat_t *stat);
 int ef_run_loop(ef_runtime_t *rt);
 
+/*
+ * block the signals and stop the loop when any of them delivered,
+ * call it before creating other threads, they inherit the signal mask
+ */
+int ef_stop_on_signals(ef_runtime_t *rt, const int *signals, int count);
+
+/*
+ * thread safe, proc will be called in the loop thread, not in a routine,
+ * the tasks posted before the loop exits all run, after that it returns
+ * -1 with errno ESHUTDOWN, the runtime must outlive the calls
+ */
+int ef_runtime_post(ef_runtime_t *rt, ef_post_proc_t proc, void *arg);
+
+ef_routine_t *ef_routine_spawn(ef_spawn_proc_t proc, void *arg);
+int ef_routine_join(ef_routine_t *er, ef_routine_t *target, long *retval);
+int ef_routine_detach(ef_routine_t *target);
+
+int ef_routine_yield(ef_routine_t *er);
+long ef_routine_park(ef_routine_t *er);
+long ef_routine_park_on(ef_routine_t *er, ef_list_entry_t *wait_list);
+int ef_routine_wake(ef_routine_t *er);
+
+/*
+ * the routine is woken up from where it blocked, and all its blocking
+ * calls fail with errno ECANCELED from now on
+ */
+int ef_routine_cancel(ef_routine_t *er);
+
+int ef_routine_poll(ef_routine_t *er, const int *fds, int *events, int n, int millisecs);
+/*
+ * close the fds the routine waited on with it, the backends cache the
+ * registration of an fd until told it is closed
+ */
 int ef_routine_close(ef_routine_t *er, int fd);
 int ef_routine_connect(ef_routine_t *er, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 ssize_t ef_routine_read(ef_routine_t *er, int fd, void *buf, size_t count);
 ssize_t ef_routine_write(ef_routine_t *er, int fd, const void *buf, size_t count);
 ssize_t ef_routine_recv(ef_routine_t *er, int sockfd, void *buf, size_t len, int flags);
 ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t len, int flags);
+ssize_t ef_routine_readv(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt);
+ssize_t ef_routine_writev(ef_routine_t *er, int fd, const struct iovec *iov, int iovcnt);
+ssize_t ef_routine_recvmsg(ef_routine_t *er, int sockfd, struct msghdr *msg, int flags);
+ssize_t ef_routine_sendmsg(ef_routine_t *er, int sockfd, const struct msghdr *msg, int flags);
+
+/*
+ * loop until all count bytes written, or read unless eof comes first,
+ * the syscalls are retried at once after a partial transfer, the poll
+ * backend is used only when they would block, -1 on errors
+ */
+ssize_t ef_routine_write_all(ef_routine_t *er, int fd, const void *buf, size_t count);
+ssize_t ef_routine_read_exact(ef_routine_t *er, int fd, void *buf, size_t count);
+
+/*
+ * the same for a vector, the entries of iov are modified as written
+ */
+ssize_t ef_routine_writev_all(ef_routine_t *er, int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * opt in coalescing, the writes of the routine to fd are buffered and
+ * go out in one writev when the routine is about to block or yield, so
+ * once a loop tick at most, or when size bytes reached, 0 means
+ * EF_DEFAULT_OUTPUT_BUFFER, flush for latency sensitive points, the
+ * buffer is released by close or when the routine returns
+ */
+int ef_routine_buffer_output(ef_routine_t *er, int fd, size_t size);
+int ef_routine_flush(ef_routine_t *er);
+
+/*
+ * moves up to len bytes from in_fd to out_fd inside the kernel through a
+ * pipe of the loop, returns the bytes moved or 0 at the end of in_fd,
+ * copies through a buffer where the fds can not be spliced
+ */
+ssize_t ef_routine_splice(ef_routine_t *er, int in_fd, int out_fd, size_t len);
+
+/*
+ * splices until the end of in_fd, returns the bytes moved
+ */
+ssize_t ef_routine_forward_all(ef_routine_t *er, int in_fd, int out_fd);
+
+#define ef_wrap_join(target, retval) \
+    ef_routine_join(NULL, target, retval)
+
+#define ef_wrap_yield() \
+    ef_routine_yield(NULL)
+
+#define ef_wrap_park() \
+    ef_routine_park(NULL)
+
+#define ef_wrap_poll(fds, events, n, millisecs) \
+    ef_routine_poll(NULL, fds, events, n, millisecs)
 
 #define ef_wrap_close(fd) \
     ef_routine_close(NULL, fd)
@@ -107,4 +489,37 @@ ssize_t ef_routine_send(ef_routine_t *er, int sockfd, const void *buf, size_t le
 #define ef_wrap_send(sockfd, buf, len, flags) \
     ef_routine_send(NULL, sockfd, buf, len, flags)
 
+#define ef_wrap_readv(fd, iov, iovcnt) \
+    ef_routine_readv(NULL, fd, iov, iovcnt)
+
+#define ef_wrap_writev(fd, iov, iovcnt) \
+    ef_routine_writev(NULL, fd, iov, iovcnt)
+
+#define ef_wrap_recvmsg(sockfd, msg, flags) \
+    ef_routine_recvmsg(NULL, sockfd, msg, flags)
+
+#define ef_wrap_sendmsg(sockfd, msg, flags) \
+    ef_routine_sendmsg(NULL, sockfd, msg, flags)
+
+#define ef_wrap_write_all(fd, buf, count) \
+    ef_routine_write_all(NULL, fd, buf, count)
+
+#define ef_wrap_read_exact(fd, buf, count) \
+    ef_routine_read_exact(NULL, fd, buf, count)
+
+#define ef_wrap_writev_all(fd, iov, iovcnt) \
+    ef_routine_writev_all(NULL, fd, iov, iovcnt)
+
+#define ef_wrap_buffer_output(fd, size) \
+    ef_routine_buffer_output(NULL, fd, size)
+
+#define ef_wrap_flush() \
+    ef_routine_flush(NULL)
+
+#define ef_wrap_splice(in_fd, out_fd, len) \
+    ef_routine_splice(NULL, in_fd, out_fd, len)
+
+#define ef_wrap_forward_all(in_fd, out_fd) \
+    ef_routine_forward_all(NULL, in_fd, out_fd)
+
 #endif
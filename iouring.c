@@ -0,0 +1,547 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "poll.h"
+#include "uring.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*
+ * user_data of an sqe is fd, seq and kind, a completion is stale
+ * when the seq of the fd moved on, or nothing is in flight
+ */
+#define EF_IOURING_POLL   0
+#define EF_IOURING_OP     1
+#define EF_IOURING_CANCEL 2
+
+#define EF_IOURING_SEQ_MASK 0x3fffffff
+
+/*
+ * one oneshot poll and one op in flight at most for every fd,
+ * the poll is re-armed by associate or unset, op_stop set when
+ * the op cancelled but its completion still reported
+ */
+typedef struct _ef_iouring_fd {
+    unsigned int poll_seq;
+    int polling;
+    int events;
+    void *poll_ptr;
+    unsigned int op_seq;
+    int op;
+    int op_stop;
+    void *op_ptr;
+} ef_iouring_fd_t;
+
+/*
+ * an op still in flight when its fd closed, the owner waits for the
+ * completion, and the fd number may be taken by a new file meanwhile
+ */
+typedef struct _ef_iouring_orphan ef_iouring_orphan_t;
+
+struct _ef_iouring_orphan {
+    ef_iouring_orphan_t *next;
+    int fd;
+    unsigned int seq;
+    int op;
+    void *ptr;
+};
+
+typedef struct _ef_iouring {
+    ef_poll_t poll;
+    ef_uring_t ring;
+    int cap;
+    int fd_cap;
+    int no_multishot;
+    ef_iouring_fd_t *fds;
+    ef_iouring_orphan_t *orphans;
+} ef_iouring_t;
+
+static inline __u64 ef_iouring_data(int fd, unsigned int seq, int kind)
+{
+    return ((__u64)(unsigned int)fd << 32) | ((__u64)(seq & EF_IOURING_SEQ_MASK) << 2) | kind;
+}
+
+static int ef_iouring_expand(ef_iouring_t *ep, int fd)
+{
+    int fd_cap = ep->fd_cap;
+    ef_iouring_fd_t *fds;
+
+    while (fd_cap <= fd) {
+        fd_cap <<= 1;
+    }
+
+    fds = (ef_iouring_fd_t *)realloc(ep->fds, sizeof(ef_iouring_fd_t) * fd_cap);
+    if (!fds) {
+        return -1;
+    }
+
+    memset(&fds[ep->fd_cap], 0, sizeof(ef_iouring_fd_t) * (fd_cap - ep->fd_cap));
+    ep->fds = fds;
+    ep->fd_cap = fd_cap;
+    return 0;
+}
+
+static ef_uring_sqe_t *ef_iouring_get_sqe(ef_iouring_t *ep)
+{
+    ef_uring_sqe_t *sqe = ef_uring_get_sqe(&ep->ring);
+
+    /*
+     * the sq is full, submit what queued without waiting
+     */
+    if (!sqe && ef_uring_enter(&ep->ring, 0, 0) >= 0) {
+        sqe = ef_uring_get_sqe(&ep->ring);
+    }
+    if (!sqe) {
+        errno = EBUSY;
+    }
+    return sqe;
+}
+
+static int ef_iouring_poll_add(ef_iouring_t *ep, int fd, ef_iouring_fd_t *ef)
+{
+    ef_uring_sqe_t *sqe = ef_iouring_get_sqe(ep);
+
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ef->events;
+    sqe->user_data = ef_iouring_data(fd, ++ef->poll_seq, EF_IOURING_POLL);
+    ef->polling = 1;
+    return 0;
+}
+
+static int ef_iouring_accept(ef_iouring_t *ep, int fd, ef_iouring_fd_t *ef)
+{
+    ef_uring_sqe_t *sqe = ef_iouring_get_sqe(ep);
+
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (!ep->no_multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = ef_iouring_data(fd, ++ef->op_seq, EF_IOURING_OP);
+    return 0;
+}
+
+static void ef_iouring_cancel(ef_iouring_t *ep, __u64 data)
+{
+    ef_uring_sqe_t *sqe = ef_iouring_get_sqe(ep);
+
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = data;
+        sqe->user_data = ef_iouring_data(0, 0, EF_IOURING_CANCEL);
+    }
+}
+
+/*
+ * move the op out of the fd slot, it stays in the slot if no memory
+ */
+static int ef_iouring_orphan(ef_iouring_t *ep, int fd, ef_iouring_fd_t *ef)
+{
+    ef_iouring_orphan_t *o = (ef_iouring_orphan_t *)malloc(sizeof(ef_iouring_orphan_t));
+
+    if (!o) {
+        return -1;
+    }
+
+    o->fd = fd;
+    o->seq = ef->op_seq & EF_IOURING_SEQ_MASK;
+    o->op = ef->op;
+    o->ptr = ef->op_ptr;
+    o->next = ep->orphans;
+    ep->orphans = o;
+    return 0;
+}
+
+/*
+ * the owner of an orphaned completion, NULL if none, a connection
+ * accepted after its listener closed has nobody to take it
+ */
+static void *ef_iouring_adopt(ef_iouring_t *ep, int fd, unsigned int seq, int res, int more)
+{
+    ef_iouring_orphan_t **pp = &ep->orphans;
+    ef_iouring_orphan_t *o;
+    void *ptr;
+
+    while ((o = *pp) != NULL && (o->fd != fd || o->seq != seq)) {
+        pp = &o->next;
+    }
+    if (!o) {
+        return NULL;
+    }
+
+    ptr = o->ptr;
+    if (o->op == EF_OP_ACCEPT) {
+        if (res >= 0) {
+            close(res);
+        }
+        ptr = NULL;
+    }
+
+    if (!more) {
+        *pp = o->next;
+        free(o);
+    }
+    return ptr;
+}
+
+EF_POLL_FUNC int ef_iouring_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+{
+    ef_iouring_t *ep = (ef_iouring_t *)p;
+    ef_iouring_fd_t *ef;
+
+    if (fd >= ep->fd_cap && ef_iouring_expand(ep, fd) < 0) {
+        return -1;
+    }
+
+    ef = &ep->fds[fd];
+    ef->poll_ptr = ptr;
+
+    /*
+     * the poll is oneshot, arm it again after fired
+     */
+    if (ef->polling) {
+        if (ef->events == events) {
+            return 0;
+        }
+        ef_iouring_cancel(ep, ef_iouring_data(fd, ef->poll_seq, EF_IOURING_POLL));
+        ef->polling = 0;
+    }
+
+    ef->events = events;
+    if (ef_iouring_poll_add(ep, fd, ef) < 0) {
+        ef->poll_ptr = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+EF_POLL_FUNC int ef_iouring_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+{
+    ef_iouring_t *ep = (ef_iouring_t *)p;
+    ef_iouring_fd_t *ef;
+
+    if (fd >= ep->fd_cap) {
+        return 0;
+    }
+
+    ef = &ep->fds[fd];
+    ef->poll_ptr = NULL;
+    if (ef->polling) {
+        ef_iouring_cancel(ep, ef_iouring_data(fd, ef->poll_seq, EF_IOURING_POLL));
+        ef->polling = 0;
+    }
+
+    /*
+     * the cancelled op still completes to its owner, when the fd is
+     * going to be closed it waits aside, the slot is for the next file
+     */
+    if (ef->op) {
+        ef_iouring_cancel(ep, ef_iouring_data(fd, ef->op_seq, EF_IOURING_OP));
+        ef->op_stop = 1;
+        if (onclose && ef_iouring_orphan(ep, fd, ef) == 0) {
+            ef->op = 0;
+            ef->op_ptr = NULL;
+        }
+    }
+    return 0;
+}
+
+EF_POLL_FUNC int ef_iouring_unset(ef_poll_t *p, int fd, int events)
+{
+    ef_iouring_t *ep = (ef_iouring_t *)p;
+    ef_iouring_fd_t *ef;
+
+    if (fd >= ep->fd_cap) {
+        return 0;
+    }
+
+    /*
+     * the event consumed by someone else, poll again for the waiter
+     */
+    ef = &ep->fds[fd];
+    if (ef->poll_ptr && !ef->polling) {
+        return ef_iouring_poll_add(ep, fd, ef);
+    }
+    return 0;
+}
+
+static int ef_iouring_submit(ef_poll_t *p, int op, int fd, void *buf, size_t len, int flags, void *ptr)
+{
+    ef_iouring_t *ep = (ef_iouring_t *)p;
+    ef_iouring_fd_t *ef;
+    ef_uring_sqe_t *sqe;
+
+    if (fd < 0 || op < EF_OP_RECV || op > EF_OP_SENDMSG) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fd >= ep->fd_cap && ef_iouring_expand(ep, fd) < 0) {
+        return -1;
+    }
+
+    ef = &ep->fds[fd];
+    ef->op = op;
+    ef->op_stop = 0;
+    ef->op_ptr = ptr;
+
+    if (op == EF_OP_ACCEPT) {
+        if (ef_iouring_accept(ep, fd, ef) < 0) {
+            ef->op = 0;
+            return -1;
+        }
+        return 0;
+    }
+
+    sqe = ef_iouring_get_sqe(ep);
+    if (!sqe) {
+        ef->op = 0;
+        return -1;
+    }
+
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)buf;
+    sqe->len = (__u32)len;
+    switch (op) {
+    case EF_OP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->msg_flags = flags;
+        break;
+    case EF_OP_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = flags;
+        break;
+    case EF_OP_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->off = (__u64)-1;
+        break;
+    case EF_OP_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->off = (__u64)-1;
+        break;
+    case EF_OP_CONNECT:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->len = 0;
+        sqe->off = len;
+        break;
+    case EF_OP_READV:
+        sqe->opcode = IORING_OP_READV;
+        sqe->off = (__u64)-1;
+        break;
+    case EF_OP_WRITEV:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->off = (__u64)-1;
+        break;
+    case EF_OP_RECVMSG:
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        break;
+    case EF_OP_SENDMSG:
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        break;
+    }
+    sqe->user_data = ef_iouring_data(fd, ++ef->op_seq, EF_IOURING_OP);
+    return 0;
+}
+
+EF_POLL_FUNC int ef_iouring_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+{
+    ef_iouring_t *ep = (ef_iouring_t *)p;
+    ef_uring_cqe_t *cqe;
+    int cnt = 0;
+
+    if (count > ep->cap) {
+        count = ep->cap;
+    }
+
+    /*
+     * one syscall submits everything queued since the last wait and waits
+     */
+    if (ef_uring_enter(&ep->ring, millisecs != 0, millisecs) < 0) {
+        return -1;
+    }
+
+    while (cnt < count && (cqe = ef_uring_peek_cqe(&ep->ring)) != NULL) {
+        __u64 data = cqe->user_data;
+        int res = cqe->res;
+        int more = cqe->flags & IORING_CQE_F_MORE;
+        int fd = (int)(data >> 32);
+        unsigned int seq = (unsigned int)(data >> 2) & EF_IOURING_SEQ_MASK;
+        ef_iouring_fd_t *ef;
+
+        ef_uring_cqe_seen(&ep->ring);
+        if ((data & 3) == EF_IOURING_CANCEL || fd >= ep->fd_cap) {
+            continue;
+        }
+
+        ef = &ep->fds[fd];
+        if ((data & 3) == EF_IOURING_POLL) {
+            if (!ef->polling || (ef->poll_seq & EF_IOURING_SEQ_MASK) != seq) {
+                continue;
+            }
+            ef->polling = 0;
+            if (!ef->poll_ptr) {
+                continue;
+            }
+            evts[cnt].events = res < 0 ? EF_POLLERR : res;
+            evts[cnt].res = 0;
+            evts[cnt].ptr = ef->poll_ptr;
+            ++cnt;
+            continue;
+        }
+
+        if (!ef->op || (ef->op_seq & EF_IOURING_SEQ_MASK) != seq) {
+            if (ep->orphans && (evts[cnt].ptr = ef_iouring_adopt(ep, fd, seq, res, more)) != NULL) {
+                evts[cnt].events = EF_POLLDONE;
+                evts[cnt].res = res;
+                ++cnt;
+            }
+            continue;
+        }
+
+        if (!more) {
+
+            /*
+             * keep accepting, one by one where multishot not supported,
+             * give up only when the fd cannot accept at all
+             */
+            if (ef->op == EF_OP_ACCEPT && !ef->op_stop && res == -EINVAL && !ep->no_multishot) {
+                ep->no_multishot = 1;
+                if (ef_iouring_accept(ep, fd, ef) == 0) {
+                    continue;
+                }
+                ef->op = 0;
+            } else if (ef->op == EF_OP_ACCEPT && !ef->op_stop && res != -EBADF && res != -ENOTSOCK && res != -EINVAL) {
+                if (ef_iouring_accept(ep, fd, ef) < 0) {
+                    ef->op = 0;
+                }
+            } else {
+                ef->op = 0;
+            }
+        }
+
+        evts[cnt].events = EF_POLLDONE;
+        evts[cnt].res = res;
+        evts[cnt].ptr = ef->op_ptr;
+        ++cnt;
+    }
+    return cnt;
+}
+
+static int ef_iouring_free(ef_poll_t *p)
+{
+    ef_iouring_t *ep = (ef_iouring_t *)p;
+    ef_uring_free(&ep->ring);
+    while (ep->orphans) {
+        ef_iouring_orphan_t *o = ep->orphans;
+        ep->orphans = o->next;
+        free(o);
+    }
+    free(ep->fds);
+    free(ep);
+    return 0;
+}
+
+static ef_poll_t *ef_iouring_create(int cap)
+{
+    ef_iouring_t *ep;
+
+    /*
+     * event buffer at least 128
+     */
+    if (cap < 128) {
+        cap = 128;
+    }
+
+    ep = (ef_iouring_t *)malloc(sizeof(ef_iouring_t));
+    if (!ep) {
+        return NULL;
+    }
+
+    /*
+     * the fd table grows on demand
+     */
+    ep->fd_cap = 1024;
+    ep->fds = (ef_iouring_fd_t *)calloc(ep->fd_cap, sizeof(ef_iouring_fd_t));
+    if (!ep->fds) {
+        free(ep);
+        return NULL;
+    }
+
+    /*
+     * only the loop thread submits, task work runs when it enters
+     */
+    if (ef_uring_init(&ep->ring, cap, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) < 0) {
+        free(ep->fds);
+        free(ep);
+        return NULL;
+    }
+
+    /*
+     * waiting with a timeout needs the extended arg
+     */
+    if (!(ep->ring.features & IORING_FEAT_EXT_ARG)) {
+        ef_uring_free(&ep->ring);
+        free(ep->fds);
+        free(ep);
+        return NULL;
+    }
+
+    ep->poll.associate = ef_iouring_associate;
+    ep->poll.dissociate = ef_iouring_dissociate;
+    ep->poll.unset = ef_iouring_unset;
+    ep->poll.wait = ef_iouring_wait;
+    ep->poll.free = ef_iouring_free;
+    ep->poll.submit = ef_iouring_submit;
+    ep->poll.ctl_saved = 0;
+    ep->cap = cap;
+    ep->no_multishot = 0;
+    ep->orphans = NULL;
+    return &ep->poll;
+}
+
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_iouring_##op
+
+const ef_poll_backend_t ef_poll_backend_iouring = {"iouring", ef_iouring_create};
+
+#ifndef EF_POLL_REGISTRY
+create_func_t ef_create_poll = ef_iouring_create;
+#endif
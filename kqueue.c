@@ -85,7 +85,7 @@ static int ef_kqueue_expand(ef_kqueue_t *ep, int fd)
     return 0;
 }
 
-static int ef_kqueue_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+EF_POLL_FUNC int ef_kqueue_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
 {
     ef_kqueue_t *ep;
     kevent_t *e;
@@ -130,7 +130,7 @@ static int ef_kqueue_associate(ef_poll_t *p, int fd, int events, void *ptr, int
     return 0;
 }
 
-static int ef_kqueue_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+EF_POLL_FUNC int ef_kqueue_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
 {
     ef_kqueue_t *ep;
     kevent_t *e;
@@ -171,12 +171,12 @@ static int ef_kqueue_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
     return 0;
 }
 
-static int ef_kqueue_unset(ef_poll_t *p, int fd, int events)
+EF_POLL_FUNC int ef_kqueue_unset(ef_poll_t *p, int fd, int events)
 {
     return 0;
 }
 
-static int ef_kqueue_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+EF_POLL_FUNC int ef_kqueue_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
 {
     int ret, idx;
     struct timespec timeout;
@@ -266,6 +266,8 @@ static ef_poll_t *ef_kqueue_create(int cap)
     ep->poll.unset = ef_kqueue_unset;
     ep->poll.wait = ef_kqueue_wait;
     ep->poll.free = ef_kqueue_free;
+    ep->poll.submit = NULL;
+    ep->poll.ctl_saved = 0;
     ep->cap = cap;
     return &ep->poll;
 
@@ -282,4 +284,13 @@ error_exit:
     return NULL;
 }
 
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_kqueue_##op
+
+const ef_poll_backend_t ef_poll_backend_kqueue = {"kqueue", ef_kqueue_create};
+
+#ifndef EF_POLL_REGISTRY
 create_func_t ef_create_poll = ef_kqueue_create;
+#endif
@@ -0,0 +1,885 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#define _GNU_SOURCE
+#include "poll.h"
+#include "loopback.h"
+#include "util/list.h"
+#include "util/util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#define EF_LOOPBACK_BACKLOG 128
+
+typedef struct pollfd pollfd_t;
+
+/*
+ * eof when the peer closed or shut down writing, broken when the peer
+ * closed, buf[head, head + len) of the ring is received and not read
+ */
+typedef struct _ef_loopback_sock {
+    int used;
+    int flags;
+    int port;
+    int listening;
+    int peer;
+    int eof;
+    int broken;
+    char *buf;
+    size_t head;
+    size_t len;
+
+    /*
+     * connections not accepted yet
+     */
+    int *backlog;
+    int backlog_cap;
+    int backlog_head;
+    int backlog_len;
+
+    /*
+     * the poll interest, in the ready list while queued, removed by
+     * the wait finding it not ready or nobody waiting
+     */
+    int mask;
+    int waiting;
+    int queued;
+    void *ptr;
+    ef_list_entry_t ready_entry;
+    int next_free;
+} ef_loopback_sock_t;
+
+/*
+ * shared by the socket calls and the backend, so only one loop can use it,
+ * sockets are kept for reuse with their buffers
+ */
+typedef struct _ef_loopback_table {
+    ef_loopback_sock_t **socks;
+    int cap;
+    int count;
+    int free_head;
+    ef_list_entry_t ready_list;
+} ef_loopback_table_t;
+
+/*
+ * the fds not from the loopback, polled by the system
+ */
+typedef struct _ef_loopback_real {
+    int fd;
+    int mask;
+    int waiting;
+    void *ptr;
+} ef_loopback_real_t;
+
+typedef struct _ef_loopback {
+    ef_poll_t poll;
+    int real_cap;
+    int real_cnt;
+    ef_loopback_real_t *reals;
+    pollfd_t *pfds;
+} ef_loopback_t;
+
+static ef_loopback_table_t ef_loopback = {NULL, 0, 0, -1, {NULL, NULL}};
+
+static ef_loopback_sock_t *ef_loopback_get(int fd)
+{
+    int idx = fd - EF_LOOPBACK_FD_BASE;
+    if (idx < 0 || idx >= ef_loopback.count || !ef_loopback.socks[idx]->used) {
+        return NULL;
+    }
+    return ef_loopback.socks[idx];
+}
+
+static int ef_loopback_alloc(void)
+{
+    ef_loopback_sock_t *s;
+    int idx = ef_loopback.free_head;
+
+    if (!ef_loopback.ready_list.next) {
+        ef_list_init(&ef_loopback.ready_list);
+    }
+
+    if (idx >= 0) {
+        s = ef_loopback.socks[idx];
+        ef_loopback.free_head = s->next_free;
+    } else {
+
+        /*
+         * every time multiply 2
+         */
+        if (ef_loopback.count >= ef_loopback.cap) {
+            int cap = ef_loopback.cap ? ef_loopback.cap << 1 : 1024;
+            ef_loopback_sock_t **socks = (ef_loopback_sock_t **)realloc(ef_loopback.socks, sizeof(ef_loopback_sock_t *) * cap);
+            if (!socks) {
+                errno = ENOMEM;
+                return -1;
+            }
+            ef_loopback.socks = socks;
+            ef_loopback.cap = cap;
+        }
+        s = (ef_loopback_sock_t *)calloc(1, sizeof(ef_loopback_sock_t));
+        if (!s) {
+            errno = ENOMEM;
+            return -1;
+        }
+        idx = ef_loopback.count++;
+        ef_loopback.socks[idx] = s;
+    }
+
+    s->used = 1;
+    s->flags = O_RDWR;
+    s->port = 0;
+    s->listening = 0;
+    s->peer = -1;
+    s->eof = 0;
+    s->broken = 0;
+    s->head = 0;
+    s->len = 0;
+    s->backlog_head = 0;
+    s->backlog_len = 0;
+    s->mask = 0;
+    s->waiting = 0;
+    s->queued = 0;
+    s->ptr = NULL;
+    return idx + EF_LOOPBACK_FD_BASE;
+}
+
+static int ef_loopback_events(ef_loopback_sock_t *s)
+{
+    int events = 0;
+
+    if (s->listening) {
+        return s->backlog_len ? EF_POLLIN : 0;
+    }
+
+    if (s->len || s->eof) {
+        events |= EF_POLLIN;
+    }
+    if (s->eof) {
+        events |= EF_POLLHUP;
+    }
+
+    /*
+     * writes fail at once when broken
+     */
+    if (s->broken || (s->peer >= 0 && ef_loopback_get(s->peer)->len < EF_LOOPBACK_BUFFER)) {
+        events |= EF_POLLOUT;
+    }
+    return events;
+}
+
+/*
+ * queue the socket if its state changed to what is waited
+ */
+static void ef_loopback_notify(ef_loopback_sock_t *s)
+{
+    if (s->waiting && !s->queued && (ef_loopback_events(s) & (s->mask | EF_POLLERR | EF_POLLHUP))) {
+        s->queued = 1;
+        ef_list_insert_before(&ef_loopback.ready_list, &s->ready_entry);
+    }
+}
+
+int ef_loopback_socket(int domain, int type, int protocol)
+{
+    int fd;
+
+    if ((domain != AF_INET && domain != AF_INET6) || (type & 0xf) != SOCK_STREAM) {
+        return socket(domain, type, protocol);
+    }
+
+    fd = ef_loopback_alloc();
+#ifdef SOCK_NONBLOCK
+    if (fd >= 0 && (type & SOCK_NONBLOCK)) {
+        ef_loopback_get(fd)->flags |= O_NONBLOCK;
+    }
+#endif
+    return fd;
+}
+
+static int ef_loopback_port(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET6) {
+        return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+    }
+    return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+static ef_loopback_sock_t *ef_loopback_find(int port)
+{
+    for (int idx = 0; idx < ef_loopback.count; ++idx) {
+        ef_loopback_sock_t *s = ef_loopback.socks[idx];
+        if (s->used && s->listening && s->port == port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+int ef_loopback_bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd);
+    if (!s) {
+        return bind(fd, addr, addrlen);
+    }
+
+    s->port = ef_loopback_port(addr);
+    return 0;
+}
+
+int ef_loopback_listen(int fd, int backlog)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd);
+    if (!s) {
+        return listen(fd, backlog);
+    }
+
+    if (ef_loopback_find(s->port)) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    if (backlog <= 0) {
+        backlog = EF_LOOPBACK_BACKLOG;
+    }
+    if (backlog > s->backlog_cap) {
+        int *queue = (int *)realloc(s->backlog, sizeof(int) * backlog);
+        if (!queue) {
+            errno = ENOMEM;
+            return -1;
+        }
+        s->backlog = queue;
+        s->backlog_cap = backlog;
+    }
+    s->listening = 1;
+    return 0;
+}
+
+int ef_loopback_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd);
+    int conn;
+
+    if (!s) {
+#ifdef __linux__
+        return accept4(fd, addr, addrlen, flags);
+#else
+        return accept(fd, addr, addrlen);
+#endif
+    }
+
+    if (!s->listening) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!s->backlog_len) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    conn = s->backlog[s->backlog_head];
+    s->backlog_head = (s->backlog_head + 1) % s->backlog_cap;
+    --s->backlog_len;
+
+#ifdef SOCK_NONBLOCK
+    if (flags & SOCK_NONBLOCK) {
+        ef_loopback_get(conn)->flags |= O_NONBLOCK;
+    }
+#endif
+
+    /*
+     * every peer is the loopback address
+     */
+    if (addr && addrlen) {
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (*addrlen > sizeof(sin)) {
+            *addrlen = sizeof(sin);
+        }
+        memcpy(addr, &sin, *addrlen);
+    }
+    return conn;
+}
+
+int ef_loopback_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    if (!ef_loopback_get(fd)) {
+        return accept(fd, addr, addrlen);
+    }
+    return ef_loopback_accept4(fd, addr, addrlen, 0);
+}
+
+int ef_loopback_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd), *ls, *conn;
+    int conn_fd;
+
+    if (!s) {
+        return connect(fd, addr, addrlen);
+    }
+
+    if (s->peer >= 0 || s->listening) {
+        errno = EISCONN;
+        return -1;
+    }
+
+    /*
+     * established at once, or refused when the backlog is full
+     */
+    ls = ef_loopback_find(ef_loopback_port(addr));
+    if (!ls || ls->backlog_len >= ls->backlog_cap) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    conn_fd = ef_loopback_alloc();
+    if (conn_fd < 0) {
+        return -1;
+    }
+
+    conn = ef_loopback_get(conn_fd);
+    conn->port = ls->port;
+    conn->peer = fd;
+    s->peer = conn_fd;
+
+    ls->backlog[(ls->backlog_head + ls->backlog_len) % ls->backlog_cap] = conn_fd;
+    ++ls->backlog_len;
+    ef_loopback_notify(ls);
+    return 0;
+}
+
+int ef_loopback_shutdown(int fd, int how)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd), *peer;
+    if (!s) {
+        return shutdown(fd, how);
+    }
+
+    if (s->peer < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (how != SHUT_RD) {
+        peer = ef_loopback_get(s->peer);
+        peer->eof = 1;
+        ef_loopback_notify(peer);
+    }
+    return 0;
+}
+
+int ef_loopback_close(int fd)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd), *peer;
+    if (!s) {
+        return close(fd);
+    }
+
+    /*
+     * the connections never accepted are closed, their peers see eof
+     */
+    if (s->listening) {
+        s->listening = 0;
+        while (s->backlog_len) {
+            int conn = s->backlog[s->backlog_head];
+            s->backlog_head = (s->backlog_head + 1) % s->backlog_cap;
+            --s->backlog_len;
+            ef_loopback_close(conn);
+        }
+    }
+
+    if (s->peer >= 0) {
+        peer = ef_loopback_get(s->peer);
+        peer->peer = -1;
+        peer->eof = 1;
+        peer->broken = 1;
+        ef_loopback_notify(peer);
+    }
+
+    if (s->queued) {
+        ef_list_remove(&s->ready_entry);
+    }
+    s->used = 0;
+    s->next_free = ef_loopback.free_head;
+    ef_loopback.free_head = fd - EF_LOOPBACK_FD_BASE;
+    return 0;
+}
+
+int ef_loopback_fcntl(int fd, int cmd, ...)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd);
+    va_list ap;
+    long arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, long);
+    va_end(ap);
+
+    if (!s) {
+        return fcntl(fd, cmd, arg);
+    }
+
+    switch (cmd) {
+    case F_GETFL:
+        return s->flags;
+    case F_SETFL:
+        s->flags = (int)arg;
+        return 0;
+    case F_GETFD:
+    case F_SETFD:
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+int ef_loopback_setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen)
+{
+    if (!ef_loopback_get(fd)) {
+        return setsockopt(fd, level, optname, optval, optlen);
+    }
+    return 0;
+}
+
+/*
+ * only SO_ERROR has a value, it is always 0
+ */
+int ef_loopback_getsockopt(int fd, int level, int optname, void *optval, socklen_t *optlen)
+{
+    if (!ef_loopback_get(fd)) {
+        return getsockopt(fd, level, optname, optval, optlen);
+    }
+
+    if (*optlen >= sizeof(int)) {
+        *(int *)optval = 0;
+        *optlen = sizeof(int);
+    }
+    return 0;
+}
+
+/*
+ * nothing blocks in one thread, the calls fail with EAGAIN instead
+ */
+ssize_t ef_loopback_recv(int fd, void *buf, size_t len, int flags)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd), *peer;
+    size_t n, first;
+
+    if (!s) {
+        return recv(fd, buf, len, flags);
+    }
+
+    if (!s->len) {
+        if (s->eof) {
+            return 0;
+        }
+        errno = (s->peer >= 0) ? EAGAIN : ENOTCONN;
+        return -1;
+    }
+
+    n = len < s->len ? len : s->len;
+    first = EF_LOOPBACK_BUFFER - s->head;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(buf, s->buf + s->head, first);
+    memcpy((char *)buf + first, s->buf, n - first);
+
+    if (!(flags & MSG_PEEK)) {
+        s->head = (s->head + n) % EF_LOOPBACK_BUFFER;
+        s->len -= n;
+
+        /*
+         * room freed for the writer
+         */
+        if (s->peer >= 0) {
+            peer = ef_loopback_get(s->peer);
+            ef_loopback_notify(peer);
+        }
+    }
+    return (ssize_t)n;
+}
+
+ssize_t ef_loopback_send(int fd, const void *buf, size_t len, int flags)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd), *peer;
+    size_t n, tail, first;
+
+    if (!s) {
+        return send(fd, buf, len, flags);
+    }
+
+    if (s->broken) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (s->peer < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    peer = ef_loopback_get(s->peer);
+    if (!peer->buf) {
+        peer->buf = (char *)malloc(EF_LOOPBACK_BUFFER);
+        if (!peer->buf) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    n = EF_LOOPBACK_BUFFER - peer->len;
+    if (!n) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (n > len) {
+        n = len;
+    }
+
+    tail = (peer->head + peer->len) % EF_LOOPBACK_BUFFER;
+    first = EF_LOOPBACK_BUFFER - tail;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(peer->buf + tail, buf, first);
+    memcpy(peer->buf, (const char *)buf + first, n - first);
+    peer->len += n;
+
+    ef_loopback_notify(peer);
+    return (ssize_t)n;
+}
+
+ssize_t ef_loopback_read(int fd, void *buf, size_t count)
+{
+    if (!ef_loopback_get(fd)) {
+        return read(fd, buf, count);
+    }
+    return ef_loopback_recv(fd, buf, count, 0);
+}
+
+ssize_t ef_loopback_write(int fd, const void *buf, size_t count)
+{
+    if (!ef_loopback_get(fd)) {
+        return write(fd, buf, count);
+    }
+    return ef_loopback_send(fd, buf, count, 0);
+}
+
+/*
+ * one entry after another, stops at the first short one
+ */
+ssize_t ef_loopback_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    ssize_t done = 0;
+
+    if (!ef_loopback_get(fd)) {
+        return recvmsg(fd, msg, flags);
+    }
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+    for (size_t idx = 0; idx < msg->msg_iovlen; ++idx) {
+        ssize_t n = ef_loopback_recv(fd, msg->msg_iov[idx].iov_base, msg->msg_iov[idx].iov_len, flags);
+        if (n < 0) {
+            return done ? done : n;
+        }
+        done += n;
+        if ((size_t)n < msg->msg_iov[idx].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+ssize_t ef_loopback_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    ssize_t done = 0;
+
+    if (!ef_loopback_get(fd)) {
+        return sendmsg(fd, msg, flags);
+    }
+
+    for (size_t idx = 0; idx < msg->msg_iovlen; ++idx) {
+        ssize_t n = ef_loopback_send(fd, msg->msg_iov[idx].iov_base, msg->msg_iov[idx].iov_len, flags);
+        if (n < 0) {
+            return done ? done : n;
+        }
+        done += n;
+        if ((size_t)n < msg->msg_iov[idx].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+ssize_t ef_loopback_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+
+    if (!ef_loopback_get(fd)) {
+        return readv(fd, iov, iovcnt);
+    }
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return ef_loopback_recvmsg(fd, &msg, 0);
+}
+
+ssize_t ef_loopback_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+
+    if (!ef_loopback_get(fd)) {
+        return writev(fd, iov, iovcnt);
+    }
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return ef_loopback_sendmsg(fd, &msg, 0);
+}
+
+#ifdef __linux__
+ssize_t ef_loopback_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags)
+{
+    /*
+     * nothing in the kernel to splice, callers copy instead
+     */
+    if (ef_loopback_get(fd_in) || ef_loopback_get(fd_out)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+#endif
+
+static ef_loopback_real_t *ef_loopback_real(ef_loopback_t *lp, int fd, int create)
+{
+    ef_loopback_real_t *reals;
+    pollfd_t *pfds;
+    int idx;
+
+    for (idx = 0; idx < lp->real_cnt; ++idx) {
+        if (lp->reals[idx].fd == fd) {
+            return &lp->reals[idx];
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    if (lp->real_cnt >= lp->real_cap) {
+        int cap = lp->real_cap << 1;
+        reals = (ef_loopback_real_t *)realloc(lp->reals, sizeof(ef_loopback_real_t) * cap);
+        if (!reals) {
+            return NULL;
+        }
+        lp->reals = reals;
+        pfds = (pollfd_t *)realloc(lp->pfds, sizeof(pollfd_t) * cap);
+        if (!pfds) {
+            return NULL;
+        }
+        lp->pfds = pfds;
+        lp->real_cap = cap;
+    }
+
+    lp->reals[lp->real_cnt].fd = fd;
+    lp->reals[lp->real_cnt].mask = 0;
+    lp->reals[lp->real_cnt].waiting = 0;
+    return &lp->reals[lp->real_cnt++];
+}
+
+EF_POLL_FUNC int ef_loopback_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+{
+    ef_loopback_sock_t *s = ef_loopback_get(fd);
+    ef_loopback_real_t *r;
+
+    /*
+     * level triggered, stays waiting after fired
+     */
+    if (fired) {
+        return 0;
+    }
+
+    if (s) {
+        s->mask = events;
+        s->ptr = ptr;
+        s->waiting = 1;
+        ef_loopback_notify(s);
+        return 0;
+    }
+
+    r = ef_loopback_real((ef_loopback_t *)p, fd, 1);
+    if (!r) {
+        return -1;
+    }
+    r->mask = events;
+    r->ptr = ptr;
+    r->waiting = 1;
+    return 0;
+}
+
+EF_POLL_FUNC int ef_loopback_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+{
+    ef_loopback_t *lp = (ef_loopback_t *)p;
+    ef_loopback_sock_t *s = ef_loopback_get(fd);
+    ef_loopback_real_t *r;
+
+    if (s) {
+        s->waiting = 0;
+        return 0;
+    }
+
+    r = ef_loopback_real(lp, fd, 0);
+    if (!r) {
+        return 0;
+    }
+    r->waiting = 0;
+
+    /*
+     * the fd number may be reused by another real fd
+     */
+    if (onclose) {
+        *r = lp->reals[--lp->real_cnt];
+    }
+    return 0;
+}
+
+EF_POLL_FUNC int ef_loopback_unset(ef_poll_t *p, int fd, int events)
+{
+    return 0;
+}
+
+EF_POLL_FUNC int ef_loopback_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+{
+    ef_loopback_t *lp = (ef_loopback_t *)p;
+    ef_list_entry_t reported;
+    int idx, nfds = 0, cnt = 0;
+
+    /*
+     * the system fds, blocking only when no socket in memory is ready
+     */
+    if (!ef_list_empty(&ef_loopback.ready_list)) {
+        millisecs = 0;
+    }
+    for (idx = 0; idx < lp->real_cnt; ++idx) {
+        if (lp->reals[idx].waiting) {
+            lp->pfds[nfds].fd = lp->reals[idx].fd;
+            lp->pfds[nfds].events = lp->reals[idx].mask;
+            lp->pfds[nfds].revents = 0;
+            ++nfds;
+        }
+    }
+    if (nfds || millisecs) {
+        int ret = poll(lp->pfds, nfds, millisecs);
+        if (ret < 0) {
+            return ret;
+        }
+        for (idx = 0; idx < nfds && ret > 0 && cnt < count; ++idx) {
+            if (lp->pfds[idx].revents) {
+                --ret;
+                evts[cnt].events = lp->pfds[idx].revents;
+                evts[cnt].ptr = ef_loopback_real(lp, lp->pfds[idx].fd, 0)->ptr;
+                ++cnt;
+            }
+        }
+    }
+
+    /*
+     * level triggered, reported sockets go to the tail and get checked
+     * again next time, so the rest get their turn when over count
+     */
+    ef_list_init(&reported);
+    while (cnt < count && !ef_list_empty(&ef_loopback.ready_list)) {
+        ef_loopback_sock_t *s = CAST_PARENT_PTR(ef_list_remove_after(&ef_loopback.ready_list), ef_loopback_sock_t, ready_entry);
+        int events = s->waiting ? ef_loopback_events(s) & (s->mask | EF_POLLERR | EF_POLLHUP) : 0;
+        if (!events) {
+            s->queued = 0;
+            continue;
+        }
+        evts[cnt].events = events;
+        evts[cnt].ptr = s->ptr;
+        ++cnt;
+        ef_list_insert_before(&reported, &s->ready_entry);
+    }
+    while (!ef_list_empty(&reported)) {
+        ef_list_insert_before(&ef_loopback.ready_list, ef_list_remove_after(&reported));
+    }
+    return cnt;
+}
+
+static int ef_loopback_free(ef_poll_t *p)
+{
+    ef_loopback_t *lp = (ef_loopback_t *)p;
+    free(lp->reals);
+    free(lp->pfds);
+    free(lp);
+    return 0;
+}
+
+static ef_poll_t *ef_loopback_create(int cap)
+{
+    ef_loopback_t *lp = (ef_loopback_t *)malloc(sizeof(ef_loopback_t));
+    if (!lp) {
+        return NULL;
+    }
+
+    lp->real_cap = 8;
+    lp->real_cnt = 0;
+    lp->reals = (ef_loopback_real_t *)malloc(sizeof(ef_loopback_real_t) * lp->real_cap);
+    lp->pfds = (pollfd_t *)malloc(sizeof(pollfd_t) * lp->real_cap);
+    if (!lp->reals || !lp->pfds) {
+        free(lp->reals);
+        free(lp->pfds);
+        free(lp);
+        return NULL;
+    }
+
+    if (!ef_loopback.ready_list.next) {
+        ef_list_init(&ef_loopback.ready_list);
+    }
+
+    lp->poll.associate = ef_loopback_associate;
+    lp->poll.dissociate = ef_loopback_dissociate;
+    lp->poll.unset = ef_loopback_unset;
+    lp->poll.wait = ef_loopback_wait;
+    lp->poll.free = ef_loopback_free;
+    lp->poll.submit = NULL;
+    lp->poll.ctl_saved = 0;
+    return &lp->poll;
+}
+
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_loopback_##op
+
+const ef_poll_backend_t ef_poll_backend_loopback = {"loopback", ef_loopback_create};
+
+#ifndef EF_POLL_REGISTRY
+create_func_t ef_create_poll = ef_loopback_create;
+#endif
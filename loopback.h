@@ -0,0 +1,96 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _LOOPBACK_HEADER_
+#define _LOOPBACK_HEADER_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * stream sockets of the loopback backend live in memory, their fds start
+ * from EF_LOOPBACK_FD_BASE, the calls below pass the other fds to the
+ * system, a listener is found by the port it bound, all in one thread
+ */
+#define EF_LOOPBACK_FD_BASE 0x1000000
+
+/*
+ * bytes buffered in each direction of a connection
+ */
+#define EF_LOOPBACK_BUFFER 65536
+
+int ef_loopback_socket(int domain, int type, int protocol);
+int ef_loopback_bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int ef_loopback_listen(int fd, int backlog);
+int ef_loopback_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int ef_loopback_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+int ef_loopback_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int ef_loopback_shutdown(int fd, int how);
+int ef_loopback_close(int fd);
+int ef_loopback_fcntl(int fd, int cmd, ...);
+int ef_loopback_setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen);
+int ef_loopback_getsockopt(int fd, int level, int optname, void *optval, socklen_t *optlen);
+ssize_t ef_loopback_read(int fd, void *buf, size_t count);
+ssize_t ef_loopback_write(int fd, const void *buf, size_t count);
+ssize_t ef_loopback_recv(int fd, void *buf, size_t len, int flags);
+ssize_t ef_loopback_send(int fd, const void *buf, size_t len, int flags);
+ssize_t ef_loopback_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t ef_loopback_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t ef_loopback_recvmsg(int fd, struct msghdr *msg, int flags);
+ssize_t ef_loopback_sendmsg(int fd, const struct msghdr *msg, int flags);
+#ifdef __linux__
+ssize_t ef_loopback_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+#endif
+
+#endif
+
+/*
+ * define EF_LOOPBACK_SHIM before including to route the socket calls of
+ * the file to the loopback, the framework does so built with EF_LOOPBACK
+ */
+#if defined(EF_LOOPBACK_SHIM) && !defined(_LOOPBACK_SHIM_)
+#define _LOOPBACK_SHIM_
+
+#define socket(domain, type, protocol) ef_loopback_socket(domain, type, protocol)
+#define bind(fd, addr, addrlen) ef_loopback_bind(fd, addr, addrlen)
+#define listen(fd, backlog) ef_loopback_listen(fd, backlog)
+#define accept(fd, addr, addrlen) ef_loopback_accept(fd, addr, addrlen)
+#define accept4(fd, addr, addrlen, flags) ef_loopback_accept4(fd, addr, addrlen, flags)
+#define connect(fd, addr, addrlen) ef_loopback_connect(fd, addr, addrlen)
+#define shutdown(fd, how) ef_loopback_shutdown(fd, how)
+#define close(fd) ef_loopback_close(fd)
+#define fcntl(fd, ...) ef_loopback_fcntl(fd, __VA_ARGS__)
+#define setsockopt(fd, level, optname, optval, optlen) ef_loopback_setsockopt(fd, level, optname, optval, optlen)
+#define getsockopt(fd, level, optname, optval, optlen) ef_loopback_getsockopt(fd, level, optname, optval, optlen)
+#define read(fd, buf, count) ef_loopback_read(fd, buf, count)
+#define write(fd, buf, count) ef_loopback_write(fd, buf, count)
+#define recv(fd, buf, len, flags) ef_loopback_recv(fd, buf, len, flags)
+#define send(fd, buf, len, flags) ef_loopback_send(fd, buf, len, flags)
+#define readv(fd, iov, iovcnt) ef_loopback_readv(fd, iov, iovcnt)
+#define writev(fd, iov, iovcnt) ef_loopback_writev(fd, iov, iovcnt)
+#define recvmsg(fd, msg, flags) ef_loopback_recvmsg(fd, msg, flags)
+#define sendmsg(fd, msg, flags) ef_loopback_sendmsg(fd, msg, flags)
+#ifdef __linux__
+#define splice(fd_in, off_in, fd_out, off_out, len, flags) ef_loopback_splice(fd_in, off_in, fd_out, off_out, len, flags)
+#endif
+
+#endif
@@ -23,6 +23,8 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include "framework.h"
+#include "stream.h"
+#include "watchdog.h"
 
 ef_runtime_t efr = {0};
 
@@ -49,28 +51,16 @@ long forward_proc(int fd, ef_routine_t *er)
     {
         return ret;
     }
-    ssize_t w = ef_routine_write(er, sockfd, buffer, r);
+    ssize_t w = ef_routine_write_all(er, sockfd, buffer, r);
     if(w < 0)
     {
         goto exit_proc;
     }
-    while(1)
+    // the response goes back through a pipe, not copied by us
+    ssize_t f = ef_routine_forward_all(er, sockfd, fd);
+    if(f < 0)
     {
-        r = ef_routine_read(er, sockfd, buffer, BUFFER_SIZE);
-        if(r <= 0)
-        {
-            break;
-        }
-        ssize_t wrt = 0;
-        while(wrt < r)
-        {
-            w = ef_routine_write(er, fd, &buffer[wrt], r - wrt);
-            if(w < 0)
-            {
-                goto exit_proc;
-            }
-            wrt += w;
-        }
+        ret = -1;
     }
 exit_proc:
     ef_routine_close(er, sockfd);
@@ -80,41 +70,43 @@ exit_proc:
 long greeting_proc(int fd, ef_routine_t *er)
 {
     char resp_ok[] = "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 26\r\nContent-Type: text/plain; charset=utf-8\r\n\r\nWelcome to the EFramework!";
-    char buffer[BUFFER_SIZE];
-    ssize_t r = ef_routine_read(er, fd, buffer, BUFFER_SIZE);
-    if(r <= 0)
+    ef_stream_t stream;
+    const char *line;
+    size_t len;
+    if(ef_stream_init(&stream, fd, er) < 0)
     {
-        return r;
+        return -1;
     }
-    r = sizeof(resp_ok) - 1;
-    ssize_t wrt = 0;
-    while(wrt < r)
+    // the request head ends with an empty line
+    do
     {
-        ssize_t w = ef_routine_write(er, fd, &resp_ok[wrt], r - wrt);
-        if(w < 0)
+        ssize_t r = ef_stream_read_line(&stream, &line, &len);
+        if(r <= 0)
         {
-            return w;
+            ef_stream_free(&stream);
+            return r;
         }
-        wrt += w;
+    } while(len > 0);
+    ef_stream_free(&stream);
+    ssize_t w = ef_routine_write_all(er, fd, resp_ok, sizeof(resp_ok) - 1);
+    if(w < 0)
+    {
+        return w;
     }
     return 0;
 }
 
-void signal_handler(int num)
-{
-    efr.stopping = 1;
-}
-
 int main(int argc, char *argv[])
 {
     if (ef_init(&efr, 64 * 1024, 256, 512, 1000 * 60, 16) < 0) {
         return -1;
     }
 
-    struct sigaction sa = {0};
-    sa.sa_handler = signal_handler;
-    sigaction(SIGHUP, &sa, NULL);
-    sigaction(SIGINT, &sa, NULL);
+    int signals[] = {SIGHUP, SIGINT, SIGTERM};
+    if (ef_stop_on_signals(&efr, signals, sizeof(signals) / sizeof(signals[0])) < 0) {
+        return -1;
+    }
+    efr.drain_millisecs = 1000 * 10;
 
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if(sockfd < 0)
@@ -146,5 +138,16 @@ int main(int argc, char *argv[])
     listen(sockfd, 512);
     ef_add_listen(&efr, sockfd, greeting_proc);
 
+#ifdef EF_ENABLE_WATCHDOG
+    // report the routines holding the loop longer than 100ms to stderr
+    ef_watchdog_t wd;
+    if (ef_watchdog_start(&wd, &efr, EF_DEFAULT_WATCHDOG_MILLISECS, 2) < 0) {
+        return -1;
+    }
+    retval = ef_run_loop(&efr);
+    ef_watchdog_stop(&wd);
+    return retval;
+#else
     return ef_run_loop(&efr);
+#endif
 }
@@ -82,7 +82,7 @@ static int ef_poll_expand(ef_pollsys_t *ep, int fd)
     return 0;
 }
 
-static int ef_poll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+EF_POLL_FUNC int ef_poll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
 {
     ef_pollsys_t *ep;
     pollfd_t *pf;
@@ -115,7 +115,7 @@ static int ef_poll_associate(ef_poll_t *p, int fd, int events, void *ptr, int fi
     return 0;
 }
 
-static int ef_poll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+EF_POLL_FUNC int ef_poll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
 {
     ef_pollsys_t *ep;
     int idx, last;
@@ -154,12 +154,12 @@ static int ef_poll_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
     return 0;
 }
 
-static int ef_poll_unset(ef_poll_t *p, int fd, int events)
+EF_POLL_FUNC int ef_poll_unset(ef_poll_t *p, int fd, int events)
 {
     return 0;
 }
 
-static int ef_poll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+EF_POLL_FUNC int ef_poll_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
 {
     int ret, idx, cnt;
     ef_pollsys_t *ep = (ef_pollsys_t *)p;
@@ -239,9 +239,20 @@ static ef_poll_t *ef_poll_create(int cap)
     ep->poll.unset = ef_poll_unset;
     ep->poll.wait = ef_poll_wait;
     ep->poll.free = ef_poll_free;
+    ep->poll.submit = NULL;
+    ep->poll.ctl_saved = 0;
     ep->cap = cap;
     ep->nfds = 0;
     return &ep->poll;
 }
 
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_poll_##op
+
+const ef_poll_backend_t ef_poll_backend_poll = {"poll", ef_poll_create};
+
+#ifndef EF_POLL_REGISTRY
 create_func_t ef_create_poll = ef_poll_create;
+#endif
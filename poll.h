@@ -21,6 +21,19 @@
 #ifndef _POLL_HEADER_
 #define _POLL_HEADER_
 
+#include <stddef.h>
+
+/*
+ * linkage of the ops the framework calls, external when the backend is
+ * compiled into the framework by EF_POLL_INLINE, as the inline helpers
+ * there cannot refer to static functions
+ */
+#ifdef EF_POLL_INLINE
+#define EF_POLL_FUNC
+#else
+#define EF_POLL_FUNC static
+#endif
+
 typedef struct _ef_event ef_event_t;
 typedef struct _ef_poll ef_poll_t;
 
@@ -31,9 +44,23 @@ typedef int (*dissociate_func_t)(ef_poll_t *p, int fd, int fired, int onclose);
 typedef int (*unset_func_t)(ef_poll_t *p, int fd, int events);
 typedef int (*wait_func_t)(ef_poll_t *p, ef_event_t *evts, int count, int millisecs);
 typedef int (*free_func_t)(ef_poll_t *p);
+typedef int (*submit_func_t)(ef_poll_t *p, int op, int fd, void *buf, size_t len, int flags, void *ptr);
 
+/*
+ * filled by the backend wait, not a copy of the native event:
+ * epoll registers once and keeps fd in data, so stale events of
+ * fds nobody waits for are dropped and ptr is looked up here,
+ * epolluring also reports the failed batched ctls as EF_POLLERR,
+ * epollet reports from its ready list and iouring from the cqes,
+ * handing out the native array would move all that into the loop
+ */
 struct _ef_event {
     int events;
+
+    /*
+     * the result of a submitted op when events is EF_POLLDONE
+     */
+    int res;
     void *ptr;
 };
 
@@ -43,10 +70,45 @@ struct _ef_poll {
     unset_func_t unset;
     wait_func_t wait;
     free_func_t free;
+
+    /*
+     * completion based backends do the op and report EF_POLLDONE with
+     * the result, NULL for readiness only backends
+     */
+    submit_func_t submit;
+
+    /*
+     * control syscalls saved by keeping fds registered between waits,
+     * a backend doing so needs every fd dissociated with onclose before closed
+     */
+    unsigned long ctl_saved;
 };
 
 extern create_func_t ef_create_poll;
 
+/*
+ * every backend exports one, built with EF_POLL_REGISTRY and backends.c
+ * all the backends linked are selectable at runtime
+ */
+typedef struct _ef_poll_backend ef_poll_backend_t;
+
+struct _ef_poll_backend {
+    const char *name;
+    create_func_t create;
+};
+
+/*
+ * pick the backend ef_create_poll creates, by name or "auto" to take the
+ * fastest in a short calibration run, the EF_POLL environment variable
+ * is used if never called, and the first registered if neither set
+ */
+int ef_poll_select(const char *name);
+
+/*
+ * the name of the backend selected or created
+ */
+const char *ef_poll_selected(void);
+
 /*
  * the macros are equal in poll and epoll
  */
@@ -55,4 +117,27 @@ extern create_func_t ef_create_poll;
 #define EF_POLLERR 0x008
 #define EF_POLLHUP 0x010
 
+/*
+ * a submitted op completed
+ */
+#define EF_POLLDONE 0x10000
+
+/*
+ * ops for submit, buf and len of EF_OP_CONNECT are the address,
+ * EF_OP_ACCEPT keeps accepting non-blocking fds until dissociated,
+ * completes once for every fd, buf and len of EF_OP_READV and
+ * EF_OP_WRITEV are the iovec array and count, buf of EF_OP_RECVMSG
+ * and EF_OP_SENDMSG is the msghdr
+ */
+#define EF_OP_RECV    1
+#define EF_OP_SEND    2
+#define EF_OP_READ    3
+#define EF_OP_WRITE   4
+#define EF_OP_CONNECT 5
+#define EF_OP_ACCEPT  6
+#define EF_OP_READV   7
+#define EF_OP_WRITEV  8
+#define EF_OP_RECVMSG 9
+#define EF_OP_SENDMSG 10
+
 #endif
@@ -31,13 +31,13 @@ typedef struct _ef_port {
     port_event_t events[0];
 } ef_port_t;
 
-static int ef_port_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
+EF_POLL_FUNC int ef_port_associate(ef_poll_t *p, int fd, int events, void *ptr, int fired)
 {
     ef_port_t *ep = (ef_port_t *)p;
     return port_associate(ep->ptfd, PORT_SOURCE_FD, fd, events, ptr);
 }
 
-static int ef_port_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
+EF_POLL_FUNC int ef_port_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
 {
     ef_port_t *ep;
 
@@ -52,12 +52,12 @@ static int ef_port_dissociate(ef_poll_t *p, int fd, int fired, int onclose)
     return port_dissociate(ep->ptfd, PORT_SOURCE_FD, fd);
 }
 
-static int ef_port_unset(ef_poll_t *p, int fd, int events)
+EF_POLL_FUNC int ef_port_unset(ef_poll_t *p, int fd, int events)
 {
     return 0;
 }
 
-static int ef_port_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
+EF_POLL_FUNC int ef_port_wait(ef_poll_t *p, ef_event_t *evts, int count, int millisecs)
 {
     uint_t nget, idx;
     timespec_t timeout;
@@ -126,8 +126,19 @@ static ef_poll_t *ef_port_create(int cap)
     ep->poll.unset = ef_port_unset;
     ep->poll.wait = ef_port_wait;
     ep->poll.free = ef_port_free;
+    ep->poll.submit = NULL;
+    ep->poll.ctl_saved = 0;
     ep->cap = cap;
     return &ep->poll;
 }
 
+/*
+ * the ops called directly when compiled into the framework by EF_POLL_INLINE
+ */
+#define EF_POLL_OPS(op) ef_port_##op
+
+const ef_poll_backend_t ef_poll_backend_port = {"port", ef_port_create};
+
+#ifndef EF_POLL_REGISTRY
 create_func_t ef_create_poll = ef_port_create;
+#endif
@@ -0,0 +1,220 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "stream.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * one loop thread, so is the pool
+ */
+static char *ef_stream_pool[EF_STREAM_POOL];
+static int ef_stream_pooled = 0;
+
+/*
+ * return the index of the first c, n if none, the memchr of the libc
+ * is vectorized already, picking the widest kernel the cpu supports
+ */
+static size_t ef_stream_scan(const char *ptr, size_t n, int c)
+{
+    const char *found = (const char *)memchr(ptr, c, n);
+    return found ? (size_t)(found - ptr) : n;
+}
+
+int ef_stream_init(ef_stream_t *s, int fd, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (ef_stream_pooled > 0) {
+        s->buf = ef_stream_pool[--ef_stream_pooled];
+    } else {
+        s->buf = (char *)malloc(EF_STREAM_BUFFER);
+        if (!s->buf) {
+            return -1;
+        }
+    }
+
+    s->fd = fd;
+    s->eof = 0;
+    s->er = er;
+    s->start = 0;
+    s->end = 0;
+    s->scanned = 0;
+    return 0;
+}
+
+void ef_stream_free(ef_stream_t *s)
+{
+    if (!s->buf) {
+        return;
+    }
+
+    if (ef_stream_pooled < EF_STREAM_POOL) {
+        ef_stream_pool[ef_stream_pooled++] = s->buf;
+    } else {
+        free(s->buf);
+    }
+    s->buf = NULL;
+}
+
+/*
+ * one read for as much as the buffer holds, 0 at eof
+ */
+static ssize_t ef_stream_fill(ef_stream_t *s)
+{
+    ssize_t r;
+
+    if (s->eof) {
+        return 0;
+    }
+
+    /*
+     * move the unconsumed bytes to the front when no room behind
+     */
+    if (s->start == s->end) {
+        s->start = s->end = 0;
+    } else if (s->end == EF_STREAM_BUFFER && s->start > 0) {
+        memmove(s->buf, s->buf + s->start, s->end - s->start);
+        s->end -= s->start;
+        s->start = 0;
+    }
+
+    if (s->end == EF_STREAM_BUFFER) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    r = ef_routine_read(s->er, s->fd, s->buf + s->end, EF_STREAM_BUFFER - s->end);
+    if (r < 0) {
+        return -1;
+    } else if (r == 0) {
+        s->eof = 1;
+    }
+    s->end += r;
+    return r;
+}
+
+ssize_t ef_stream_peek(ef_stream_t *s, size_t n, const char **data)
+{
+    if (n > EF_STREAM_BUFFER) {
+        n = EF_STREAM_BUFFER;
+    }
+
+    while (s->end - s->start < n) {
+        ssize_t r = ef_stream_fill(s);
+        if (r < 0) {
+            return -1;
+        } else if (r == 0) {
+            break;
+        }
+    }
+
+    *data = s->buf + s->start;
+    return (ssize_t)(s->end - s->start);
+}
+
+void ef_stream_consume(ef_stream_t *s, size_t n)
+{
+    if (n > s->end - s->start) {
+        n = s->end - s->start;
+    }
+    s->start += n;
+    s->scanned = s->scanned > n ? s->scanned - n : 0;
+}
+
+ssize_t ef_stream_read_until(ef_stream_t *s, int delim, const char **data)
+{
+    size_t len = s->end - s->start;
+
+    while (1) {
+
+        /*
+         * search only the bytes arrived since the last time
+         */
+        size_t idx = s->scanned + ef_stream_scan(s->buf + s->start + s->scanned, len - s->scanned, delim);
+        if (idx < len) {
+            len = idx + 1;
+            break;
+        }
+        s->scanned = len;
+
+        ssize_t r = ef_stream_fill(s);
+        if (r < 0) {
+            return -1;
+        } else if (r == 0) {
+            break;
+        }
+        len = s->end - s->start;
+    }
+
+    *data = s->buf + s->start;
+    s->start += len;
+    s->scanned = 0;
+    return (ssize_t)len;
+}
+
+ssize_t ef_stream_read_line(ef_stream_t *s, const char **line, size_t *len)
+{
+    ssize_t r = ef_stream_read_until(s, '\n', line);
+    if (r <= 0) {
+        *len = 0;
+        return r;
+    }
+
+    *len = (size_t)r;
+    if ((*line)[*len - 1] == '\n') {
+        --*len;
+        if (*len > 0 && (*line)[*len - 1] == '\r') {
+            --*len;
+        }
+    }
+    return r;
+}
+
+ssize_t ef_stream_read(ef_stream_t *s, void *buf, size_t count)
+{
+    size_t len = s->end - s->start;
+
+    if (len == 0) {
+
+        /*
+         * no copy for what fills the buffer anyway
+         */
+        if (count >= EF_STREAM_BUFFER && !s->eof) {
+            return ef_routine_read(s->er, s->fd, buf, count);
+        }
+
+        ssize_t r = ef_stream_fill(s);
+        if (r <= 0) {
+            return r;
+        }
+        len = s->end - s->start;
+    }
+
+    if (len > count) {
+        len = count;
+    }
+    memcpy(buf, s->buf + s->start, len);
+    ef_stream_consume(s, len);
+    return (ssize_t)len;
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _STREAM_HEADER_
+#define _STREAM_HEADER_
+
+#include "framework.h"
+
+/*
+ * size of the read buffer, the longest token read_until can return
+ */
+#define EF_STREAM_BUFFER 16384
+
+/*
+ * free buffers kept for the next streams
+ */
+#define EF_STREAM_POOL 64
+
+typedef struct _ef_stream ef_stream_t;
+
+/*
+ * a buffered reader of an fd in a routine, every read takes as much as
+ * the buffer holds, buf[start, end) is read and not consumed yet, the
+ * first scanned bytes of it have no delimiter searched last time
+ */
+struct _ef_stream {
+    int fd;
+    int eof;
+    ef_routine_t *er;
+    char *buf;
+    size_t start;
+    size_t end;
+    size_t scanned;
+};
+
+/*
+ * the er parameter can be NULL, means the current routine, data returned
+ * points into the buffer and stays valid until the next call on the stream,
+ * the calls return -1 with errno set when the read fails
+ */
+int ef_stream_init(ef_stream_t *s, int fd, ef_routine_t *er);
+void ef_stream_free(ef_stream_t *s);
+
+/*
+ * wait until n bytes buffered, fewer only at eof, n no more than
+ * EF_STREAM_BUFFER, return the bytes buffered, nothing consumed
+ */
+ssize_t ef_stream_peek(ef_stream_t *s, size_t n, const char **data);
+void ef_stream_consume(ef_stream_t *s, size_t n);
+
+/*
+ * consume up to and including delim and return the length, the rest
+ * if eof comes first, 0 at eof, -1 with errno EMSGSIZE when the buffer
+ * is full without delim
+ */
+ssize_t ef_stream_read_until(ef_stream_t *s, int delim, const char **data);
+
+/*
+ * the same for '\n', len is the length of the line without "\n" or "\r\n"
+ */
+ssize_t ef_stream_read_line(ef_stream_t *s, const char **line, size_t *len);
+
+/*
+ * copy what buffered first, large reads bypass the buffer when it is empty
+ */
+ssize_t ef_stream_read(ef_stream_t *s, void *buf, size_t count);
+
+#endif
@@ -0,0 +1,351 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sync.h"
+#include "framework.h"
+#include "util/list.h"
+#include "util/util.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#define ef_first_waiter(list) \
+    CAST_PARENT_PTR(ef_list_entry_after(list), ef_routine_t, ready_entry)
+
+inline void ef_wake_one(ef_list_entry_t *wait_list) __attribute__((always_inline));
+inline void ef_wake_all(ef_list_entry_t *wait_list) __attribute__((always_inline));
+
+inline void ef_wake_one(ef_list_entry_t *wait_list)
+{
+    if (!ef_list_empty(wait_list)) {
+        ef_routine_wake(ef_first_waiter(wait_list));
+    }
+}
+
+inline void ef_wake_all(ef_list_entry_t *wait_list)
+{
+    /*
+     * ef_routine_wake removes the waiter from the list
+     */
+    while (!ef_list_empty(wait_list)) {
+        ef_routine_wake(ef_first_waiter(wait_list));
+    }
+}
+
+void ef_mutex_init(ef_mutex_t *mutex)
+{
+    mutex->owner = NULL;
+    ef_list_init(&mutex->wait_list);
+}
+
+int ef_mutex_lock(ef_mutex_t *mutex, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (mutex->owner == NULL) {
+        mutex->owner = er;
+        return 0;
+    }
+
+    /*
+     * the unlocker set owner to us before wake, else woken by others
+     */
+    while (mutex->owner != er) {
+        if (ef_routine_park_on(er, &mutex->wait_list) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ef_mutex_trylock(ef_mutex_t *mutex, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (mutex->owner != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    mutex->owner = er;
+    return 0;
+}
+
+int ef_mutex_unlock(ef_mutex_t *mutex, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (mutex->owner != er) {
+        errno = EPERM;
+        return -1;
+    }
+
+    /*
+     * hand over to the first waiter directly, so it cannot be starved
+     */
+    if (ef_list_empty(&mutex->wait_list)) {
+        mutex->owner = NULL;
+    } else {
+        mutex->owner = ef_first_waiter(&mutex->wait_list);
+        ef_routine_wake(mutex->owner);
+    }
+    return 0;
+}
+
+void ef_cond_init(ef_cond_t *cond)
+{
+    ef_list_init(&cond->wait_list);
+}
+
+/*
+ * lock it even when cancelled, a cancel meanwhile only wakes it
+ * early, the cancelled flag put back once locked
+ */
+static void ef_mutex_relock(ef_mutex_t *mutex, ef_routine_t *er)
+{
+    int cancelled = er->cancelled;
+
+    if (mutex->owner == NULL) {
+        mutex->owner = er;
+        return;
+    }
+
+    while (mutex->owner != er) {
+        er->cancelled = 0;
+        ef_routine_park_on(er, &mutex->wait_list);
+        cancelled |= er->cancelled;
+    }
+    er->cancelled = cancelled;
+}
+
+int ef_cond_wait(ef_cond_t *cond, ef_mutex_t *mutex, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    if (ef_mutex_unlock(mutex, er) < 0) {
+        return -1;
+    }
+
+    /*
+     * hold the mutex again when cancelled too, still fail the wait
+     */
+    if (ef_routine_park_on(er, &cond->wait_list) < 0 || er->cancelled) {
+        ef_mutex_relock(mutex, er);
+        errno = ECANCELED;
+        return -1;
+    }
+
+    ef_mutex_relock(mutex, er);
+    return 0;
+}
+
+int ef_cond_signal(ef_cond_t *cond)
+{
+    ef_wake_one(&cond->wait_list);
+    return 0;
+}
+
+int ef_cond_broadcast(ef_cond_t *cond)
+{
+    ef_wake_all(&cond->wait_list);
+    return 0;
+}
+
+void ef_sem_init(ef_sem_t *sem, int count)
+{
+    sem->count = count;
+    ef_list_init(&sem->wait_list);
+}
+
+int ef_sem_wait(ef_sem_t *sem, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (sem->count <= 0) {
+        if (ef_routine_park_on(er, &sem->wait_list) < 0) {
+            return -1;
+        }
+    }
+
+    --sem->count;
+    return 0;
+}
+
+int ef_sem_trywait(ef_sem_t *sem)
+{
+    if (sem->count <= 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    --sem->count;
+    return 0;
+}
+
+int ef_sem_post(ef_sem_t *sem)
+{
+    ++sem->count;
+    ef_wake_one(&sem->wait_list);
+    return 0;
+}
+
+void ef_waitgroup_init(ef_waitgroup_t *wg)
+{
+    wg->count = 0;
+    ef_list_init(&wg->wait_list);
+}
+
+int ef_waitgroup_add(ef_waitgroup_t *wg, int delta)
+{
+    wg->count += delta;
+    if (wg->count < 0) {
+        wg->count = 0;
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (wg->count == 0) {
+        ef_wake_all(&wg->wait_list);
+    }
+    return 0;
+}
+
+int ef_waitgroup_done(ef_waitgroup_t *wg)
+{
+    return ef_waitgroup_add(wg, -1);
+}
+
+int ef_waitgroup_wait(ef_waitgroup_t *wg, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (wg->count > 0) {
+        if (ef_routine_park_on(er, &wg->wait_list) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ef_chan_init(ef_chan_t *chan, int cap)
+{
+    if (cap <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    chan->items = (void **)malloc(sizeof(void *) * cap);
+    if (!chan->items) {
+        return -1;
+    }
+
+    chan->cap = cap;
+    chan->head = 0;
+    chan->count = 0;
+    chan->closed = 0;
+    ef_list_init(&chan->send_list);
+    ef_list_init(&chan->recv_list);
+    return 0;
+}
+
+int ef_chan_send(ef_chan_t *chan, void *item, ef_routine_t *er)
+{
+    int tail;
+
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (chan->count >= chan->cap && !chan->closed) {
+        if (ef_routine_park_on(er, &chan->send_list) < 0) {
+            return -1;
+        }
+    }
+
+    if (chan->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    tail = chan->head + chan->count;
+    if (tail >= chan->cap) {
+        tail -= chan->cap;
+    }
+    chan->items[tail] = item;
+    ++chan->count;
+
+    ef_wake_one(&chan->recv_list);
+    return 0;
+}
+
+int ef_chan_recv(ef_chan_t *chan, void **item, ef_routine_t *er)
+{
+    if (er == NULL) {
+        er = ef_routine_current();
+    }
+
+    while (chan->count <= 0 && !chan->closed) {
+        if (ef_routine_park_on(er, &chan->recv_list) < 0) {
+            return -1;
+        }
+    }
+
+    /*
+     * items sent before close still can be received
+     */
+    if (chan->count <= 0) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    *item = chan->items[chan->head];
+    if (++chan->head >= chan->cap) {
+        chan->head = 0;
+    }
+    --chan->count;
+
+    ef_wake_one(&chan->send_list);
+    return 0;
+}
+
+int ef_chan_close(ef_chan_t *chan)
+{
+    chan->closed = 1;
+    ef_wake_all(&chan->send_list);
+    ef_wake_all(&chan->recv_list);
+    return 0;
+}
+
+void ef_chan_free(ef_chan_t *chan)
+{
+    free(chan->items);
+    chan->items = NULL;
+}
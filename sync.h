@@ -0,0 +1,120 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _SYNC_HEADER_
+#define _SYNC_HEADER_
+
+#include "framework.h"
+#include "util/list.h"
+
+typedef struct _ef_mutex ef_mutex_t;
+typedef struct _ef_cond ef_cond_t;
+typedef struct _ef_sem ef_sem_t;
+typedef struct _ef_waitgroup ef_waitgroup_t;
+typedef struct _ef_chan ef_chan_t;
+
+/*
+ * all the waiters are parked routines chained by their ready_entry,
+ * so nothing here do syscalls or memory allocation when lock or wait
+ */
+struct _ef_mutex {
+
+    /*
+     * the routine holding the mutex, handed over to the first waiter on unlock
+     */
+    ef_routine_t *owner;
+
+    ef_list_entry_t wait_list;
+};
+
+struct _ef_cond {
+    ef_list_entry_t wait_list;
+};
+
+struct _ef_sem {
+    int count;
+    ef_list_entry_t wait_list;
+};
+
+struct _ef_waitgroup {
+    int count;
+    ef_list_entry_t wait_list;
+};
+
+struct _ef_chan {
+
+    /*
+     * ring buffer of items, allocated when init
+     */
+    void **items;
+    int cap;
+    int head;
+    int count;
+    int closed;
+
+    /*
+     * routines waiting for free space and for items
+     */
+    ef_list_entry_t send_list;
+    ef_list_entry_t recv_list;
+};
+
+/*
+ * the er parameter can be NULL, means the current routine, the blocking
+ * calls return -1 with errno ECANCELED once the routine cancelled
+ */
+void ef_mutex_init(ef_mutex_t *mutex);
+int ef_mutex_lock(ef_mutex_t *mutex, ef_routine_t *er);
+int ef_mutex_trylock(ef_mutex_t *mutex, ef_routine_t *er);
+int ef_mutex_unlock(ef_mutex_t *mutex, ef_routine_t *er);
+
+/*
+ * unlock the mutex and wait, the mutex locked again before return,
+ * also when it fails with ECANCELED, unlock it after as usual
+ */
+void ef_cond_init(ef_cond_t *cond);
+int ef_cond_wait(ef_cond_t *cond, ef_mutex_t *mutex, ef_routine_t *er);
+int ef_cond_signal(ef_cond_t *cond);
+int ef_cond_broadcast(ef_cond_t *cond);
+
+void ef_sem_init(ef_sem_t *sem, int count);
+int ef_sem_wait(ef_sem_t *sem, ef_routine_t *er);
+int ef_sem_trywait(ef_sem_t *sem);
+int ef_sem_post(ef_sem_t *sem);
+
+/*
+ * wait until the count decreased to 0 by done
+ */
+void ef_waitgroup_init(ef_waitgroup_t *wg);
+int ef_waitgroup_add(ef_waitgroup_t *wg, int delta);
+int ef_waitgroup_done(ef_waitgroup_t *wg);
+int ef_waitgroup_wait(ef_waitgroup_t *wg, ef_routine_t *er);
+
+/*
+ * a bounded channel holds at most cap items, send blocks when full and
+ * recv blocks when empty, both return -1 after the channel closed
+ */
+int ef_chan_init(ef_chan_t *chan, int cap);
+int ef_chan_send(ef_chan_t *chan, void *item, ef_routine_t *er);
+int ef_chan_recv(ef_chan_t *chan, void **item, ef_routine_t *er);
+int ef_chan_close(ef_chan_t *chan);
+void ef_chan_free(ef_chan_t *chan);
+
+#endif
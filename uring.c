@@ -0,0 +1,199 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "uring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int ef_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ef_uring_init(ef_uring_t *r, unsigned int entries, unsigned int flags)
+{
+    struct io_uring_params params;
+    unsigned int *sq_array;
+    unsigned int idx;
+    char *sq_ring, *cq_ring;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    r->fd = ef_uring_setup(entries, &params);
+
+    /*
+     * the flags only tune the task work, older kernels reject them
+     */
+    if (r->fd < 0 && errno == EINVAL && flags) {
+        memset(&params, 0, sizeof(params));
+        r->fd = ef_uring_setup(entries, &params);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->features = params.features;
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(ef_uring_cqe_t);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && r->cq_ring_size > r->sq_ring_size) {
+        r->sq_ring_size = r->cq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        goto exit_close;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+        r->cq_ring_size = 0;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            goto exit_sq;
+        }
+    }
+
+    r->sqes_size = params.sq_entries * sizeof(ef_uring_sqe_t);
+    r->sqes = (ef_uring_sqe_t *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        goto exit_cq;
+    }
+
+    sq_ring = (char *)r->sq_ring;
+    cq_ring = (char *)r->cq_ring;
+    r->sq_entries = params.sq_entries;
+    r->sq_mask = *(unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    r->sq_khead = (unsigned int *)(sq_ring + params.sq_off.head);
+    r->sq_ktail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    r->sq_tail = *r->sq_ktail;
+    r->to_submit = 0;
+    r->cq_mask = *(unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    r->cq_khead = (unsigned int *)(cq_ring + params.cq_off.head);
+    r->cq_ktail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    r->cqes = (ef_uring_cqe_t *)(cq_ring + params.cq_off.cqes);
+
+    /*
+     * sqes are used in ring order, map the index array one to one once
+     */
+    sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    for (idx = 0; idx < r->sq_entries; ++idx) {
+        sq_array[idx] = idx;
+    }
+    return 0;
+
+exit_cq:
+    if (r->cq_ring_size) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+exit_sq:
+    munmap(r->sq_ring, r->sq_ring_size);
+exit_close:
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+}
+
+void ef_uring_free(ef_uring_t *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring_size) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+int ef_uring_probe(ef_uring_t *r, int op)
+{
+    struct io_uring_probe *probe;
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    int supported = 0;
+
+    probe = (struct io_uring_probe *)calloc(1, size);
+    if (!probe) {
+        return 0;
+    }
+
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        supported = 1;
+    }
+    free(probe);
+    return supported;
+}
+
+ef_uring_sqe_t *ef_uring_get_sqe(ef_uring_t *r)
+{
+    ef_uring_sqe_t *sqe;
+
+    if (r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        return NULL;
+    }
+
+    sqe = &r->sqes[r->sq_tail & r->sq_mask];
+    ++r->sq_tail;
+    memset(sqe, 0, sizeof(ef_uring_sqe_t));
+    return sqe;
+}
+
+int ef_uring_enter(ef_uring_t *r, unsigned int wait_nr, int millisecs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = IORING_ENTER_GETEVENTS;
+    unsigned int tail = *r->sq_ktail;
+    int ret;
+
+    /*
+     * publish the sqes queued since the last enter
+     */
+    if (tail != r->sq_tail) {
+        r->to_submit += r->sq_tail - tail;
+        __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    }
+
+    if (ef_uring_cq_ready(r) > 0) {
+        wait_nr = 0;
+    }
+
+    if (wait_nr && millisecs >= 0) {
+        ts.tv_sec = millisecs / 1000;
+        ts.tv_nsec = (millisecs % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    ret = (int)syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr, flags,
+                       (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+    if (ret >= 0) {
+        r->to_submit -= ret;
+    } else if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+        return -1;
+    }
+    return ef_uring_cq_ready(r);
+}
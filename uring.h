@@ -0,0 +1,105 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _URING_HEADER_
+#define _URING_HEADER_
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * a minimal io_uring over the raw syscalls, one thread submits and reaps
+ */
+typedef struct io_uring_sqe ef_uring_sqe_t;
+typedef struct io_uring_cqe ef_uring_cqe_t;
+typedef struct _ef_uring ef_uring_t;
+
+struct _ef_uring {
+    int fd;
+    unsigned int features;
+
+    /*
+     * sq_tail is ours, published to the kernel by ef_uring_enter,
+     * to_submit is the number published but not consumed yet
+     */
+    unsigned int sq_entries;
+    unsigned int sq_mask;
+    unsigned int sq_tail;
+    unsigned int to_submit;
+    unsigned int *sq_khead;
+    unsigned int *sq_ktail;
+    ef_uring_sqe_t *sqes;
+
+    unsigned int cq_mask;
+    unsigned int *cq_khead;
+    unsigned int *cq_ktail;
+    ef_uring_cqe_t *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+int ef_uring_init(ef_uring_t *r, unsigned int entries, unsigned int flags);
+void ef_uring_free(ef_uring_t *r);
+
+/*
+ * 1 if the kernel supports the opcode
+ */
+int ef_uring_probe(ef_uring_t *r, int op);
+
+/*
+ * NULL when the sq is full, call ef_uring_enter to make room
+ */
+ef_uring_sqe_t *ef_uring_get_sqe(ef_uring_t *r);
+
+/*
+ * submit the queued sqes and wait until wait_nr cqes ready or millisecs
+ * passed, wait forever if millisecs < 0, returns cqes ready
+ */
+int ef_uring_enter(ef_uring_t *r, unsigned int wait_nr, int millisecs);
+
+inline unsigned int ef_uring_cq_ready(ef_uring_t *r) __attribute__((always_inline));
+inline ef_uring_cqe_t *ef_uring_peek_cqe(ef_uring_t *r) __attribute__((always_inline));
+inline void ef_uring_cqe_seen(ef_uring_t *r) __attribute__((always_inline));
+
+inline unsigned int ef_uring_cq_ready(ef_uring_t *r)
+{
+    return __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE) - *r->cq_khead;
+}
+
+inline ef_uring_cqe_t *ef_uring_peek_cqe(ef_uring_t *r)
+{
+    unsigned int head = *r->cq_khead;
+
+    if (head == __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+inline void ef_uring_cqe_seen(ef_uring_t *r)
+{
+    __atomic_store_n(r->cq_khead, *r->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
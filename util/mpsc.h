@@ -0,0 +1,119 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _MPSC_HEADER_
+#define _MPSC_HEADER_
+
+#include <stddef.h>
+
+/*
+ * intrusive lock-free queue, any thread can push, only one thread can pop
+ */
+typedef struct _ef_mpsc_node ef_mpsc_node_t;
+typedef struct _ef_mpsc_queue ef_mpsc_queue_t;
+
+struct _ef_mpsc_node {
+    ef_mpsc_node_t *next;
+};
+
+struct _ef_mpsc_queue {
+
+    /*
+     * producers swap the newest node in here
+     */
+    ef_mpsc_node_t *head;
+
+    /*
+     * the consumer pops from here
+     */
+    ef_mpsc_node_t *tail;
+
+    /*
+     * keep the queue never really empty
+     */
+    ef_mpsc_node_t stub;
+};
+
+inline void ef_mpsc_init(ef_mpsc_queue_t *q) __attribute__((always_inline));
+inline void ef_mpsc_push(ef_mpsc_queue_t *q, ef_mpsc_node_t *node) __attribute__((always_inline));
+inline ef_mpsc_node_t *ef_mpsc_pop(ef_mpsc_queue_t *q) __attribute__((always_inline));
+
+inline void ef_mpsc_init(ef_mpsc_queue_t *q)
+{
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+inline void ef_mpsc_push(ef_mpsc_queue_t *q, ef_mpsc_node_t *node)
+{
+    ef_mpsc_node_t *prev;
+
+    node->next = NULL;
+    prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+
+    /*
+     * the consumer cannot see the node until linked here
+     */
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+inline ef_mpsc_node_t *ef_mpsc_pop(ef_mpsc_queue_t *q)
+{
+    ef_mpsc_node_t *tail = q->tail;
+    ef_mpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    /*
+     * skip the stub node
+     */
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    /*
+     * a producer is between exchange and link, try next time
+     */
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    /*
+     * tail is the last one, push the stub back to take it out
+     */
+    ef_mpsc_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+#endif
@@ -21,10 +21,15 @@
 #ifndef _UTIL_HEADER_
 #define _UTIL_HEADER_
 
+#include <stddef.h>
+#include <time.h>
+
 #define CAST_PARENT_PTR(ptr, parent_type, field_name) \
 ((parent_type*)((char*)ptr-(char*)&((parent_type*)0)->field_name))
 
 inline size_t ef_resize(size_t size, size_t min) __attribute__((always_inline));
+inline long ef_time_millisecs(void) __attribute__((always_inline));
+inline long ef_time_microsecs(void) __attribute__((always_inline));
 
 inline size_t ef_resize(size_t size, size_t min)
 {
@@ -45,4 +50,21 @@ inline size_t ef_resize(size_t size, size_t min)
     return size + 1;
 }
 
+/*
+ * monotonic clock, not affected by system time changes
+ */
+inline long ef_time_millisecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+inline long ef_time_microsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #endif
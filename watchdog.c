@@ -0,0 +1,215 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "watchdog.h"
+#include "framework.h"
+#include <errno.h>
+
+#ifdef EF_ENABLE_WATCHDOG
+
+#include "util/util.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+#define EF_WATCHDOG_MAX_FRAMES 64
+
+/*
+ * the signal handler finds the watchdog here
+ */
+static ef_watchdog_t *ef_watchdog = NULL;
+
+/*
+ * runs in the loop thread, the routine cannot go away under it
+ */
+void ef_watchdog_handler(int num)
+{
+    void *frames[EF_WATCHDOG_MAX_FRAMES];
+    ef_watchdog_t *wd = ef_watchdog;
+    ef_coroutine_pool_t *pool;
+    ef_routine_t *er;
+    unsigned long seq;
+    void *proc;
+    char buf[256];
+    int len, error = errno;
+
+    /*
+     * not requested by the watchdog
+     */
+    if (!wd || !(seq = __atomic_exchange_n(&wd->dump_seq, 0, __ATOMIC_ACQ_REL))) {
+        return;
+    }
+
+    /*
+     * the routine yielded since sampled, nothing to report
+     */
+    pool = &wd->rt->co_pool;
+    if (pool->switch_seq != seq || pool->fiber_sched.current_fiber == &pool->fiber_sched.thread_fiber) {
+        errno = error;
+        return;
+    }
+
+    er = (ef_routine_t*)pool->fiber_sched.current_fiber;
+    proc = er->spawn_proc ? (void*)er->spawn_proc : (void*)er->poll_data.ef_proc;
+    len = snprintf(buf, sizeof(buf), "ef watchdog: routine %p fd %d running %ld ms without yield, handler:\n",
+        (void*)er, er->poll_data.fd, wd->dump_elapsed);
+    if (write(wd->report_fd, buf, len) < 0) {
+        errno = error;
+        return;
+    }
+    backtrace_symbols_fd(&proc, 1, wd->report_fd);
+
+    /*
+     * running on the stack of the stalled routine
+     */
+    int n = backtrace(frames, EF_WATCHDOG_MAX_FRAMES);
+    backtrace_symbols_fd(frames, n, wd->report_fd);
+    errno = error;
+}
+
+/*
+ * only the seq goes to the loop thread, the routine may switch or exit
+ * any time, its fields are read in the handler
+ */
+void ef_watchdog_report(ef_watchdog_t *wd, unsigned long seq, long elapsed)
+{
+    wd->dump_elapsed = elapsed;
+    __atomic_store_n(&wd->dump_seq, seq, __ATOMIC_RELEASE);
+    pthread_kill(wd->loop_thread, EF_WATCHDOG_SIGNAL);
+}
+
+void *ef_watchdog_proc(void *param)
+{
+    ef_watchdog_t *wd = (ef_watchdog_t*)param;
+    unsigned long seq, last_seq = 0, flagged_seq = 0;
+    long now, last_change = ef_time_millisecs();
+    struct timespec ts;
+
+    /*
+     * sample a few times in every threshold
+     */
+    long interval = wd->threshold_millisecs / 4;
+    if (interval < 1) {
+        interval = 1;
+    }
+    ts.tv_sec = interval / 1000;
+    ts.tv_nsec = (interval % 1000) * 1000000;
+
+    while (!__atomic_load_n(&wd->stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+
+        seq = __atomic_load_n(&wd->rt->co_pool.switch_seq, __ATOMIC_ACQUIRE);
+        now = ef_time_millisecs();
+        if (seq != last_seq) {
+            last_seq = seq;
+            last_change = now;
+            continue;
+        }
+
+        /*
+         * odd means a routine running, report once for every long run
+         */
+        if ((seq & 1) && seq != flagged_seq && now - last_change >= wd->threshold_millisecs) {
+            flagged_seq = seq;
+            ++wd->flagged;
+            ef_watchdog_report(wd, seq, now - last_change);
+        }
+    }
+    return NULL;
+}
+
+int ef_watchdog_start(ef_watchdog_t *wd, ef_runtime_t *rt, int threshold_millisecs, int report_fd)
+{
+    struct sigaction sa = {0};
+    sigset_t mask, old_mask;
+    void *frame;
+    int error;
+
+    if (ef_watchdog) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    wd->rt = rt;
+    wd->threshold_millisecs = threshold_millisecs > 0 ? threshold_millisecs : EF_DEFAULT_WATCHDOG_MILLISECS;
+    wd->report_fd = report_fd;
+    wd->stopping = 0;
+    wd->flagged = 0;
+    wd->dump_seq = 0;
+    wd->loop_thread = pthread_self();
+
+    /*
+     * backtrace may load libgcc on its first call, not good in a signal handler
+     */
+    backtrace(&frame, 1);
+
+    sa.sa_handler = ef_watchdog_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(EF_WATCHDOG_SIGNAL, &sa, NULL) < 0) {
+        return -1;
+    }
+
+    /*
+     * the watchdog thread takes no signals
+     */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+
+    ef_watchdog = wd;
+    error = pthread_create(&wd->thread, NULL, ef_watchdog_proc, wd);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (error) {
+        ef_watchdog = NULL;
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int ef_watchdog_stop(ef_watchdog_t *wd)
+{
+    if (ef_watchdog != wd) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&wd->stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(wd->thread, NULL);
+    ef_watchdog = NULL;
+    return 0;
+}
+
+#else
+
+int ef_watchdog_start(ef_watchdog_t *wd, ef_runtime_t *rt, int threshold_millisecs, int report_fd)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ef_watchdog_stop(ef_watchdog_t *wd)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
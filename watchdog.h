@@ -0,0 +1,81 @@
+// Copyright (c) 2018-2020 The EFramework Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _WATCHDOG_HEADER_
+#define _WATCHDOG_HEADER_
+
+#include "framework.h"
+#include <signal.h>
+#ifdef EF_ENABLE_WATCHDOG
+#include <pthread.h>
+#endif
+
+/*
+ * build with -DEF_ENABLE_WATCHDOG to enable, -rdynamic to get the
+ * function names in the reports
+ */
+#define EF_DEFAULT_WATCHDOG_MILLISECS 100
+
+/*
+ * the signal sent to the loop thread to dump the backtrace
+ */
+#ifndef EF_WATCHDOG_SIGNAL
+#define EF_WATCHDOG_SIGNAL SIGURG
+#endif
+
+typedef struct _ef_watchdog ef_watchdog_t;
+
+struct _ef_watchdog {
+    ef_runtime_t *rt;
+
+    /*
+     * report the routines running longer than threshold_millisecs
+     * without switching, to report_fd
+     */
+    int threshold_millisecs;
+    int report_fd;
+    int stopping;
+
+    /*
+     * the number of long runs reported
+     */
+    unsigned long flagged;
+
+#ifdef EF_ENABLE_WATCHDOG
+    pthread_t loop_thread;
+    pthread_t thread;
+
+    /*
+     * the switch_seq of the long run to report, 0 if none, the
+     * loop thread reports it only if still running
+     */
+    unsigned long dump_seq;
+    long dump_elapsed;
+#endif
+};
+
+/*
+ * call it in the loop thread, only one watchdog at a time,
+ * return -1 with errno ENOTSUP when compiled out
+ */
+int ef_watchdog_start(ef_watchdog_t *wd, ef_runtime_t *rt, int threshold_millisecs, int report_fd);
+int ef_watchdog_stop(ef_watchdog_t *wd);
+
+#endif